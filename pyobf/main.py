@@ -22,6 +22,13 @@ def is_formula(fname, args):
         print("%s unknown extension '%s'" % (errorstr, ext))
         sys.exit(1)
 
+def layer_range(s):
+    try:
+        start, end = [int(x) for x in s.split(':')]
+    except ValueError:
+        raise argparse.ArgumentTypeError("'%s' is not of the form START:END" % s)
+    return start, end
+
 def test_all(args, obfuscate):
     success = True
     if not os.path.isdir(args.test_all):
@@ -82,7 +89,13 @@ def obf(args):
                 obf.obfuscate(args.load, args.secparam, directory,
                               kappa=args.kappa, formula=formula,
                               randomization=(not args.no_randomization),
-                              seed=args.seed)
+                              seed=args.seed, container=args.container,
+                              max_layers=args.max_layers,
+                              max_memory=args.max_memory,
+                              ldu_randomizer=args.ldu_randomizer,
+                              layers=args.layers,
+                              checkpoint=args.checkpoint,
+                              resume=args.resume)
             else:
                 print('%s One of --load-obf, --load, or '
                       '--test must be used' % errorstr)
@@ -151,7 +164,7 @@ def main():
                             help='set kappa to N (for debugging)')
     parser_obf.add_argument('--load-obf',
                             metavar='DIR', action='store', type=str,
-                            help='load obfuscation from DIR')
+                            help='load obfuscation from DIR (or single-file obfuscation)')
     parser_obf.add_argument('--load',
                             metavar='FILE', action='store', type=str,
                             help='load circuit or branching program from FILE')
@@ -181,9 +194,26 @@ def main():
                             help='base of matrix branching program (default: guess)')
     parser_obf.add_argument('--seed',
                             metavar='FILE', action='store', type=str,
-                            help='load seed from FILE')
+                            help='load seed from FILE (output is reproducible for any --nthreads with the DUMMY mmap, and only with --nthreads 1 otherwise)')
     parser_obf.add_argument('--no-randomization', action='store_true',
                             help='turn of branching program randomization')
+    parser_obf.add_argument('--container', action='store_true',
+                            help='store obfuscation as a single file rather than a directory')
+    parser_obf.add_argument('--ldu-randomizer', action='store_true',
+                            help='draw randomizers as LDU products, avoiding matrix inversion')
+    parser_obf.add_argument('--checkpoint', action='store_true',
+                            help='record progress so that an interrupted run can be resumed')
+    parser_obf.add_argument('--resume', action='store_true',
+                            help='resume an interrupted --checkpoint run')
+    parser_obf.add_argument('--layers',
+                            metavar='START:END', action='store', type=layer_range,
+                            help='encode only layers START through END - 1, sharing --seed and the directory with runs on the others (DUMMY mmap only)')
+    parser_obf.add_argument('--max-layers',
+                            metavar='N', action='store', type=int, default=0,
+                            help='encode at most N layers at once (default: no limit)')
+    parser_obf.add_argument('--max-memory',
+                            metavar='BYTES', action='store', type=int, default=0,
+                            help='hold at most BYTES of encodings in memory (default: no limit)')
     parser_obf.add_argument('-v', '--verbose',
                             action='store_true',
                             help='be verbose')
@@ -1,4 +1,5 @@
 from builtins import *  # Python3 compatibility
+import numpy as np
 import pyobf._obfuscator as _obf
 from pyobf.sz_bp import SZBranchingProgram
 import pyobf.utils as utils
@@ -11,6 +12,10 @@ MMAP_DUMMY = 0x02
 OBFUSCATOR_FLAG_NONE = 0x00
 OBFUSCATOR_FLAG_NO_RANDOMIZATION = 0x01
 OBFUSCATOR_FLAG_VERBOSE = 0x04
+OBFUSCATOR_FLAG_CONTAINER = 0x08
+OBFUSCATOR_FLAG_LDU_RANDOMIZER = 0x10
+OBFUSCATOR_FLAG_CHECKPOINT = 0x20
+OBFUSCATOR_FLAG_RESUME = 0x40
 
 ENCODE_LAYER_RANDOMIZATION_TYPE_NONE = 0x00
 ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST = 0x01
@@ -28,10 +33,51 @@ def get_mmap_flag(mmap):
     else:
         return MMAP_DUMMY
 
+class EvalSession(object):
+    '''
+    An input held against an open obfuscation.  Changing a few input digits
+    only recomputes the products of the layers that read them.
+    '''
+    def __init__(self, session, base):
+        self._session = session
+        self._base = base
+
+    def result(self):
+        return _obf.session_result(self._session)
+
+    '''
+    Apply a list of (position, digit) changes and return the new output.
+    '''
+    def set(self, changes):
+        try:
+            changes = [(p, int(d, self._base)) for p, d in changes]
+        except ValueError:
+            print('{} Invalid input for base {}'.format(err_str, self._base))
+            return None
+        return _obf.session_set(self._session, changes)
+
+class EvalFuture(object):
+    '''
+    The output of an evaluation running in the background.
+    '''
+    def __init__(self, future):
+        self._future = future
+
+    def done(self):
+        return _obf.eval_done(self._future)
+
+    '''
+    Wait for the evaluation to finish and return its output.
+    '''
+    def result(self):
+        return _obf.eval_result(self._future)
+
 class Obfuscator(object):
     def __init__(self, mmap, base=None, verbose=False, nthreads=None,
                  ncores=None):
         self._state = None
+        self._handle = None
+        self._handle_dir = None
         self._verbose = verbose
         self._nthreads = nthreads
         self._ncores = ncores
@@ -40,8 +86,10 @@ class Obfuscator(object):
         self._mmap = get_mmap_flag(mmap)
 
     def _remove_old(self, directory):
-        # remove old files in obfuscation directory
-        if os.path.isdir(directory):
+        # remove old obfuscation container or files in obfuscation directory
+        if os.path.isfile(directory):
+            os.unlink(directory)
+        elif os.path.isdir(directory):
             for file in os.listdir(directory):
                 p = os.path.join(directory, file)
                 os.unlink(p)
@@ -58,22 +106,21 @@ class Obfuscator(object):
     def _init_mmap(self, secparam, kappa, nzs, directory, seed, flags):
         self.logger('Initializing mmap...')
         start = time.time()
-        if not os.path.exists(directory):
+        if not flags & OBFUSCATOR_FLAG_CONTAINER and not os.path.exists(directory):
             os.mkdir(directory)
         self._state = _obf.init(directory, self._mmap, secparam, kappa, nzs,
                                 self._nthreads, self._ncores, seed, flags)
         end = time.time()
         self.logger('Took: %f' % (end - start))
 
-    def _obfuscate(self, bp, nzs):
+    def _obfuscate(self, bp, nzs, start, end):
         nencodings = 0
-        for i in range(len(bp)):
+        for i in range(start, end):
             nrows, ncols = bp[i].matrices[0].shape
             nencodings += nrows * ncols * self._base
         self.logger('Total # Encodings: %d' % nencodings)
-        for i in range(len(bp)):
+        for i in range(start, end):
             self.logger('Obfuscating layer...')
-            mats = [bp[i].matrices[j].tolist() for j in range(self._base)]
             nrows, ncols = bp[i].matrices[0].shape
             rflags = ENCODE_LAYER_RANDOMIZATION_TYPE_NONE
             if i == 0:
@@ -82,26 +129,71 @@ class Obfuscator(object):
                 rflags |= ENCODE_LAYER_RANDOMIZATION_TYPE_LAST
             if 0 < i < len(bp) - 1:
                 rflags |= ENCODE_LAYER_RANDOMIZATION_TYPE_MIDDLE
-            pows = [[0] * nzs for _ in range(self._base)]
+            pows = np.zeros((self._base, nzs), dtype=np.int64)
             for j in range(self._base):
                 for k in bp[i].sets[j]:
-                    pows[j][k] = 1
-            _obf.encode_layer(self._state, self._base, pows, mats, i, nrows,
-                              ncols, bp[i].inp, rflags)
+                    pows[j, k] = 1
+            try:
+                # hand the layer over as flat int64 buffers when it fits
+                mats = np.ascontiguousarray(
+                    [bp[i].matrices[j] for j in range(self._base)],
+                    dtype=np.int64)
+            except (OverflowError, TypeError):
+                mats = None
+            if mats is not None:
+                _obf.encode_layer_buffers(self._state, self._base, pows,
+                                          mats, i, nrows, ncols, bp[i].inp,
+                                          rflags, nzs)
+            else:
+                mats = [bp[i].matrices[j].tolist()
+                        for j in range(self._base)]
+                _obf.encode_layer(self._state, self._base, pows.tolist(),
+                                  mats, i, nrows, ncols, bp[i].inp, rflags)
 
     '''
     Get size of obfuscation (in bytes)
     '''
     def obfsize(self, directory):
+        if os.path.isfile(directory):
+            return os.path.getsize(directory)
         size = 0
         for f in os.listdir(directory):
             size += os.path.getsize(os.path.join(directory, f))
         return size
 
+    '''
+    Obfuscate the program in `fname` into `directory`.  If `max_layers` or
+    `max_memory` (in bytes) are nonzero, at most that many layers, or that many
+    bytes of encodings, are held in memory before being written.  With
+    `ldu_randomizer`, Kilian randomizers are drawn as triangular and diagonal
+    factors rather than by inverting random matrices.  If `layers` is a
+    (start, end) pair, only layers start through end - 1 are encoded, into a
+    directory that runs on the other layers with the same `seed` complete;
+    this is only supported with the dummy mmap, as every run would share the
+    secret key's encoding randomness.
+    With `checkpoint`, finished layers are recorded in `directory` so that a
+    run killed part way can be continued by calling again with `resume`; the
+    layers it encodes then differ from those of an uninterrupted run, as the
+    encoding randomness carries on from where the finished layers left it.
+    '''
     def obfuscate(self, fname, secparam, directory, kappa=None, formula=True,
-                  randomization=True, seed=None):
+                  randomization=True, seed=None, container=False,
+                  max_layers=0, max_memory=0, ldu_randomizer=False,
+                  layers=None, checkpoint=False, resume=False):
         start = time.time()
-        self._remove_old(directory)
+        if layers is not None and (seed is None or container):
+            print('%s Encoding a range of layers needs a seed and a '
+                  'directory' % err_str)
+            return
+        if layers is not None and self._mmap != MMAP_DUMMY:
+            print('%s Encoding a range of layers needs the dummy mmap'
+                  % err_str)
+            return
+        if (checkpoint or resume) and container:
+            print('%s Checkpointing needs a directory' % err_str)
+            return
+        if layers is None and not resume:
+            self._remove_old(directory)
         bp, nzs = self._construct_bp(fname, formula=formula)
         if not kappa:
             kappa = nzs
@@ -110,43 +202,124 @@ class Obfuscator(object):
             flags |= OBFUSCATOR_FLAG_VERBOSE
         if not randomization:
             flags |= OBFUSCATOR_FLAG_NO_RANDOMIZATION
+        if container:
+            flags |= OBFUSCATOR_FLAG_CONTAINER
+        if ldu_randomizer:
+            flags |= OBFUSCATOR_FLAG_LDU_RANDOMIZER
+        if checkpoint:
+            flags |= OBFUSCATOR_FLAG_CHECKPOINT
+        if resume:
+            flags |= OBFUSCATOR_FLAG_RESUME
         self._init_mmap(secparam, kappa, nzs, directory, seed, flags)
+        if max_layers or max_memory:
+            _obf.set_budget(self._state, max_layers, max_memory)
         if self._base is None:
             self._base = len(bp[0].matrices)
-        self._obfuscate(bp, nzs)
+        first, last = layers if layers is not None else (0, len(bp))
+        if layers is not None and randomization:
+            ncols = [int(layer.matrices[0].shape[1]) for layer in bp]
+            _obf.randomizer_chain(self._state, ncols, first, last)
+        self._obfuscate(bp, nzs, first, last)
         _obf.wait(self._state)
+        if checkpoint or resume:
+            _obf.checkpoint_remove(self._state)
         end = time.time()
         self.logger('Obfuscation took: %f s' % (end - start))
         self.logger('Obfuscation size: %0.2f KB' % (self.obfsize(directory) / 1024.0))
         if self._verbose:
             _obf.max_mem_usage()
 
-    def _evaluate(self, directory, inp, f, obf, flags):
+    def _evaluate(self, directory, inp, bplen, f, obf, flags):
         self.logger('Evaluating %s...' % inp)
         start = time.time()
-        files = os.listdir(directory)
-        inputs = sorted(filter(lambda s: 'input' in s, files))
-        result = f(directory, inp, self._mmap, len(inputs), self._ncores, flags)
+        if self._handle is not None and self._handle_dir == directory:
+            result = obf.eval(self._handle, inp, self._ncores)
+        else:
+            result = f(directory, inp, self._mmap, bplen, self._ncores, flags)
         end = time.time()
         self.logger('Took: %f' % (end - start))
         if self._verbose:
             obf.max_mem_usage()
         return result
 
-    def evaluate(self, directory, inp):
-        files = os.listdir(directory)
-        if self._base:
-            base = self._base
-        else:
-            # Compute base by counting the number of files that correspond to
-            # the first MBP layer.
-            base = len(list(filter(lambda s: re.match('0.\d+', s), files)))
-        if base < 2:
-            print('{} Base cannot be < 2'.format(err_str))
+    '''
+    Keep the obfuscation in `directory` open between calls to `evaluate` and
+    `evaluate_batch`, caching up to `memcap` bytes of encoded layers (all of
+    them if `memcap` is 0).  `evaluate_batch` then works through at most
+    `nodecap` inputs at a time (no limit if 0), keeping two partial products
+    per input; by default the library's limit applies.
+    '''
+    def open(self, directory, memcap=0, nodecap=None):
+        self.close()
+        _, inplen = self._info(directory)
+        flags = OBFUSCATOR_FLAG_NONE
+        if self._verbose:
+            flags |= OBFUSCATOR_FLAG_VERBOSE
+        self.logger('Loading obfuscation...')
+        start = time.time()
+        self._handle = _obf.eval_open(directory, self._mmap, inplen, memcap,
+                                      flags)
+        if nodecap is not None:
+            _obf.eval_set_nodecap(self._handle, nodecap)
+        if self._nthreads:
+            _obf.eval_set_nthreads(self._handle, self._nthreads)
+        self._handle_dir = directory
+        end = time.time()
+        self.logger('Took: %f' % (end - start))
+
+    def close(self):
+        self._handle = None
+        self._handle_dir = None
+
+    '''
+    Start an incremental evaluation session at input `inp`, opening the
+    obfuscation in `directory` if it is not open already.
+    '''
+    def session(self, directory, inp):
+        if self._handle is None or self._handle_dir != directory:
+            self.open(directory)
+        base, inplen = self._info(directory)
+        inp = self._parse_input(inp, base, inplen)
+        if inp is None:
             return None
-        # Input length is equal to the number of `[num].input` files in
-        # `directory`.
-        inplen = len(list(filter(lambda file: re.match('\d+.input', file), files)))
+        return EvalSession(_obf.session_open(self._handle, inp, self._ncores),
+                           min(base, 36))
+
+    '''
+    Queue an evaluation on input `inp` and return an EvalFuture for its output
+    without waiting, opening the obfuscation in `directory` if it is not open
+    already.  Up to `nthreads` queued evaluations run at once.
+    '''
+    def evaluate_async(self, directory, inp):
+        if self._handle is None or self._handle_dir != directory:
+            self.open(directory)
+        base, inplen = self._info(directory)
+        inp = self._parse_input(inp, base, inplen)
+        if inp is None:
+            return None
+        return EvalFuture(_obf.eval_async(self._handle, inp, self._ncores))
+
+    def _info(self, directory):
+        if os.path.isfile(directory):
+            # Single-file obfuscations record the base and number of layers
+            # in their header.
+            base, inplen = _obf.container_info(directory)
+            if self._base:
+                base = self._base
+        else:
+            files = os.listdir(directory)
+            if self._base:
+                base = self._base
+            else:
+                # Compute base by counting the number of files that correspond
+                # to the first MBP layer.
+                base = len(list(filter(lambda s: re.match('0.\d+', s), files)))
+            # Input length is equal to the number of `[num].input` files in
+            # `directory`.
+            inplen = len(list(filter(lambda file: re.match('\d+.input', file), files)))
+        return base, inplen
+
+    def _parse_input(self, inp, base, inplen):
         if len(inp) != inplen:
             print('{} Invalid input length ({} != {})'.format(
                 err_str, len(inp), inplen))
@@ -156,11 +329,43 @@ class Obfuscator(object):
                 print("{} Bases > 36 are not quite supported, so assuming that "
                       "input encoded using base 36".format(warn_str))
                 base = 36
-            inp = [int(i, base) for i in inp]
+            return [int(i, base) for i in inp]
         except ValueError:
             print('{} Invalid input for base {}'.format(err_str, base))
             return None
+
+    def evaluate(self, directory, inp):
+        base, inplen = self._info(directory)
+        if base < 2:
+            print('{} Base cannot be < 2'.format(err_str))
+            return None
+        inp = self._parse_input(inp, base, inplen)
+        if inp is None:
+            return None
+        flags = OBFUSCATOR_FLAG_NONE
+        if self._verbose:
+            flags |= OBFUSCATOR_FLAG_VERBOSE
+        return self._evaluate(directory, inp, inplen, _obf.evaluate, _obf,
+                              flags)
+
+    '''
+    Evaluate the obfuscation on several inputs at once.  Without an open
+    handle each layer is read only once and kept until the call returns;
+    with one, the handle's cache and `memcap` apply.  Returns a list of
+    outputs, in the order of `inps`.
+    '''
+    def evaluate_batch(self, directory, inps):
+        base, inplen = self._info(directory)
+        if base < 2:
+            print('{} Base cannot be < 2'.format(err_str))
+            return None
+        inps = [self._parse_input(inp, base, inplen) for inp in inps]
+        if None in inps:
+            return None
+        if len(inps) == 0:
+            return []
         flags = OBFUSCATOR_FLAG_NONE
         if self._verbose:
             flags |= OBFUSCATOR_FLAG_VERBOSE
-        return self._evaluate(directory, inp, _obf.evaluate, _obf, flags)
+        return self._evaluate(directory, inps, inplen, _obf.evaluate, _obf,
+                              flags)
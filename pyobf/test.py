@@ -15,11 +15,28 @@ def test_obfuscation(path, testcases, args, formula=True):
                 else '%s.obf.%d' % (path, args.secparam)
     obf.obfuscate(path, args.secparam, directory, kappa=args.kappa,
                   formula=formula, randomization=(not args.no_randomization),
-                  seed=args.seed)
+                  seed=args.seed, container=args.container,
+                  max_layers=args.max_layers, max_memory=args.max_memory,
+                  ldu_randomizer=args.ldu_randomizer)
     for k, v in testcases.items():
         if obf.evaluate(directory, k) != v:
             print('%s (%s != %d) ' % (failstr, k, v))
             success = False
+    # Check the batch path both standalone and through an open handle, with
+    # more inputs than the library works through at once (256)
+    inps = list(testcases.keys())
+    inps = inps * (256 // len(inps) + 1)
+    for opened in (False, True):
+        if opened:
+            obf.open(directory)
+        results = obf.evaluate_batch(directory, inps)
+        obf.close()
+        if results is None:
+            return False
+        for k, r in zip(inps, results):
+            if r != testcases[k]:
+                print('%s (%s != %d) ' % (failstr, k, testcases[k]))
+                success = False
     return success
 
 def test_bp(path, testcases, args):
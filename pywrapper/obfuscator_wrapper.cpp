@@ -1,4 +1,5 @@
 #include <Python.h>
+#include <pthread.h>
 #include "obfuscator.h"
 #include "pyutils.h"
 
@@ -60,6 +61,7 @@ obf_encode_layer_wrapper(PyObject *self, PyObject *args)
     int **pows;
     fmpz_mat_t *mats;
     obf_state_t *s;
+    int ret;
 
     // TODO: can probably get nrows, ncols length from matrices
     if (!PyArg_ParseTuple(args, "OlOOlllll", &py_state, &n, &py_pows, &py_mats,
@@ -98,8 +100,11 @@ obf_encode_layer_wrapper(PyObject *self, PyObject *args)
         }
     }
 
-    obf_encode_layer(s, n, pows, mats, idx, inp,
-                     (encode_layer_randomization_flag_t) rflag);
+    // may block while earlier layers drain the memory budget
+    Py_BEGIN_ALLOW_THREADS
+    ret = obf_encode_layer(s, n, pows, mats, idx, inp,
+                           (encode_layer_randomization_flag_t) rflag);
+    Py_END_ALLOW_THREADS
 
     for (long c = 0; c < n; ++c) {
         fmpz_mat_clear(mats[c]);
@@ -107,9 +112,195 @@ obf_encode_layer_wrapper(PyObject *self, PyObject *args)
     free(mats);
     // TODO: make sure that pows gets cleared elsewhere
 
+    if (ret == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "encoding layer failed");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Gets a C-contiguous buffer of len int64 entries from obj, such as a numpy
+ * int64 array, setting a Python error if obj is not one.
+ */
+static int
+get_int64_buffer(PyObject *obj, Py_buffer *view, Py_ssize_t len,
+                 const char *what)
+{
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1)
+        return -1;
+    if (view->itemsize != sizeof(int64_t) || view->format == NULL
+        || strchr("lq", view->format[strlen(view->format) - 1]) == NULL
+        || view->len != len * (Py_ssize_t) sizeof(int64_t)) {
+        PyErr_Format(PyExc_ValueError, "%s must be %zd contiguous int64s",
+                     what, len);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Like encode_layer, but takes the n slot matrices as one n x nrows x ncols
+ * int64 buffer and their powers as one n x nzs int64 buffer, read without
+ * converting each entry through a Python object.
+ */
+static PyObject *
+obf_encode_layer_buffers_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_state, *py_pows, *py_mats;
+    Py_buffer pows_view, mats_view;
+    long n, idx, nrows, ncols, inp, rflag, nzs;
+    const int64_t *pows_buf, *mats_buf;
+    int **pows;
+    fmpz_mat_t *mats;
+    obf_state_t *s;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "OlOOllllll", &py_state, &n, &py_pows,
+                          &py_mats, &idx, &nrows, &ncols, &inp, &rflag, &nzs))
+        return NULL;
+
+    s = (obf_state_t *) PyCapsule_GetPointer(py_state, NULL);
+    if (s == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to extract obf state");
+        return NULL;
+    }
+
+    if (get_int64_buffer(py_pows, &pows_view, n * nzs, "pows") == -1)
+        return NULL;
+    if (get_int64_buffer(py_mats, &mats_view, n * nrows * ncols, "mats")
+        == -1) {
+        PyBuffer_Release(&pows_view);
+        return NULL;
+    }
+    pows_buf = (const int64_t *) pows_view.buf;
+    mats_buf = (const int64_t *) mats_view.buf;
+
+    pows = (int **) calloc(n, sizeof(int *));
+    mats = (fmpz_mat_t *) calloc(n, sizeof(fmpz_mat_t));
+    for (long c = 0; c < n; ++c) {
+        pows[c] = (int *) calloc(nzs, sizeof(int));
+        for (long i = 0; i < nzs; ++i) {
+            pows[c][i] = (int) pows_buf[c * nzs + i];
+        }
+        fmpz_mat_init(mats[c], nrows, ncols);
+        for (long i = 0; i < nrows; ++i) {
+            for (long j = 0; j < ncols; ++j) {
+                fmpz_set_si(fmpz_mat_entry(mats[c], i, j),
+                            mats_buf[(c * nrows + i) * ncols + j]);
+            }
+        }
+    }
+    PyBuffer_Release(&pows_view);
+    PyBuffer_Release(&mats_view);
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = obf_encode_layer(s, n, pows, mats, idx, inp,
+                           (encode_layer_randomization_flag_t) rflag);
+    Py_END_ALLOW_THREADS
+
+    for (long c = 0; c < n; ++c) {
+        fmpz_mat_clear(mats[c]);
+    }
+    free(mats);
+    // pows are read by the encoding jobs, as with encode_layer
+
+    if (ret == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "encoding layer failed");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+obf_randomizer_chain_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_state, *py_ncols;
+    obf_state_t *s;
+    uint64_t start, end;
+    ssize_t nlayers;
+    long *ncols;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "OOll", &py_state, &py_ncols, &start, &end))
+        return NULL;
+
+    s = (obf_state_t *) PyCapsule_GetPointer(py_state, NULL);
+    if (s == NULL)
+        return NULL;
+
+    nlayers = PyList_Size(py_ncols);
+    if (nlayers < 0)
+        return NULL;
+    ncols = (long *) calloc(nlayers, sizeof(long));
+    for (ssize_t i = 0; i < nlayers; ++i) {
+        ncols[i] = PyLong_AsLong(PyList_GetItem(py_ncols, i));
+    }
+
+    ret = obf_randomizer_chain(s, nlayers, ncols, start, end);
+    free(ncols);
+    if (ret == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to draw randomizers");
+        return NULL;
+    }
+
     Py_RETURN_NONE;
 }
 
+static PyObject *
+obf_evaluate_batch(char *dir, PyObject *py_inputs, enum mmap_e type,
+                   uint64_t bplen, uint64_t ncores, long flags)
+{
+    PyObject *py_results;
+    uint64_t *inputs;
+    int *results;
+    uint64_t ninputs, len;
+    int ret;
+
+    ninputs = PyList_Size(py_inputs);
+    len = PyList_Size(PyList_GetItem(py_inputs, 0));
+    inputs = (uint64_t *) calloc(ninputs * len, sizeof(uint64_t));
+    results = (int *) calloc(ninputs, sizeof(int));
+    for (uint64_t k = 0; k < ninputs; ++k) {
+        PyObject *py_input = PyList_GetItem(py_inputs, k);
+        if (!PyList_Check(py_input) || (uint64_t) PyList_Size(py_input) != len) {
+            PyErr_SetString(PyExc_RuntimeError, "inputs must have equal length");
+            free(inputs);
+            free(results);
+            return NULL;
+        }
+        for (uint64_t i = 0; i < len; ++i) {
+            inputs[k * len + i] = PyLong_AsLong(PyList_GetItem(py_input, i));
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = obf_evaluate_batch(type, dir, ninputs, len, inputs, bplen, ncores,
+                             flags, results);
+    Py_END_ALLOW_THREADS
+    if (ret == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "zero test failed");
+        free(inputs);
+        free(results);
+        return NULL;
+    }
+
+    py_results = PyList_New(ninputs);
+    for (uint64_t k = 0; k < ninputs; ++k) {
+        PyList_SetItem(py_results, k, Py_BuildValue("i", results[k] ? 0 : 1));
+    }
+    free(inputs);
+    free(results);
+    return py_results;
+}
+
+/*
+ * Evaluates the obfuscation on a single input (a list of ints), or on a batch
+ * of inputs (a list of lists of ints), in which case a list is returned.
+ */
 static PyObject *
 obf_evaluate_wrapper(PyObject *self, PyObject *args)
 {
@@ -142,12 +333,18 @@ obf_evaluate_wrapper(PyObject *self, PyObject *args)
     }
 
     len = PyList_Size(py_input);
+    if (len > 0 && PyList_Check(PyList_GetItem(py_input, 0)))
+        return obf_evaluate_batch(dir, py_input, type, bplen, ncores, flags);
+
     input = (uint64_t *) calloc(len, sizeof(uint64_t));
     for (int i = 0; i < len; ++i) {
         input[i] = PyLong_AsLong(PyList_GetItem(py_input, i));
     }
 
+    Py_BEGIN_ALLOW_THREADS
     iszero = obf_evaluate(type, dir, len, input, bplen, ncores, flags);
+    Py_END_ALLOW_THREADS
+    free(input);
     if (iszero == -1) {
         PyErr_SetString(PyExc_RuntimeError, "zero test failed");
         return NULL;
@@ -156,6 +353,533 @@ obf_evaluate_wrapper(PyObject *self, PyObject *args)
     }
 }
 
+static void
+obf_eval_close_wrapper(PyObject *self)
+{
+    obf_eval_close((obf_eval_t *) PyCapsule_GetPointer(self, NULL));
+}
+
+/*
+ * Opens a persistent evaluation handle on an obfuscation, which keeps the
+ * public parameters and up to `memcap` bytes of encoded layers in memory
+ * across calls to eval.  A `memcap` of zero caches every layer.
+ */
+static PyObject *
+obf_eval_open_wrapper(PyObject *self, PyObject *args)
+{
+    obf_eval_t *h;
+    char *dir = NULL;
+    long type_, flags;
+    enum mmap_e type;
+    uint64_t bplen = 0, memcap = 0;
+
+    if (!PyArg_ParseTuple(args, "sllll", &dir, &type_, &bplen, &memcap,
+                          &flags)) {
+        PyErr_SetString(PyExc_RuntimeError, "error parsing arguments");
+        return NULL;
+    }
+
+    switch (type_) {
+    case 0:
+        type = MMAP_CLT;
+        break;
+    case 1:
+        type = MMAP_GGHLITE;
+        break;
+    case 2:
+        type = MMAP_DUMMY;
+        break;
+    default:
+        PyErr_SetString(PyExc_RuntimeError, "invalid mmap type");
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    h = obf_eval_open(type, dir, bplen, memcap,
+                      flags & OBFUSCATOR_FLAG_VERBOSE);
+    Py_END_ALLOW_THREADS
+    if (h == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to open obfuscation");
+        return NULL;
+    }
+
+    return PyCapsule_New((void *) h, NULL, obf_eval_close_wrapper);
+}
+
+/*
+ * Evaluates an open handle on a single input, or on a list of inputs, in
+ * which case a list is returned.
+ */
+static PyObject *
+obf_eval_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_handle, *py_inputs, *py_results;
+    obf_eval_t *h;
+    uint64_t *inputs;
+    int *results;
+    uint64_t ninputs, len, ncores = 0;
+    bool batch;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "OOl", &py_handle, &py_inputs, &ncores))
+        return NULL;
+
+    h = (obf_eval_t *) PyCapsule_GetPointer(py_handle, NULL);
+    if (h == NULL)
+        return NULL;
+
+    len = PyList_Size(py_inputs);
+    batch = len > 0 && PyList_Check(PyList_GetItem(py_inputs, 0));
+    if (batch) {
+        ninputs = len;
+        len = PyList_Size(PyList_GetItem(py_inputs, 0));
+    } else {
+        ninputs = 1;
+    }
+
+    inputs = (uint64_t *) calloc(ninputs * len, sizeof(uint64_t));
+    results = (int *) calloc(ninputs, sizeof(int));
+    for (uint64_t k = 0; k < ninputs; ++k) {
+        PyObject *py_input = batch ? PyList_GetItem(py_inputs, k) : py_inputs;
+        if (!PyList_Check(py_input) || (uint64_t) PyList_Size(py_input) != len) {
+            PyErr_SetString(PyExc_RuntimeError, "inputs must have equal length");
+            free(inputs);
+            free(results);
+            return NULL;
+        }
+        for (uint64_t i = 0; i < len; ++i) {
+            inputs[k * len + i] = PyLong_AsLong(PyList_GetItem(py_input, i));
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = obf_eval_batch(h, ninputs, len, inputs, ncores, results);
+    Py_END_ALLOW_THREADS
+    if (ret == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "zero test failed");
+        free(inputs);
+        free(results);
+        return NULL;
+    }
+
+    if (batch) {
+        py_results = PyList_New(ninputs);
+        for (uint64_t k = 0; k < ninputs; ++k) {
+            PyList_SetItem(py_results, k,
+                           Py_BuildValue("i", results[k] ? 0 : 1));
+        }
+    } else {
+        py_results = Py_BuildValue("i", results[0] ? 0 : 1);
+    }
+    free(inputs);
+    free(results);
+    return py_results;
+}
+
+/*
+ * Bounds how many inputs a batch evaluation on a handle walks through at once
+ * (0 for no limit).
+ */
+static PyObject *
+obf_eval_set_nodecap_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_handle;
+    obf_eval_t *h;
+    uint64_t nodecap;
+
+    if (!PyArg_ParseTuple(args, "Ol", &py_handle, &nodecap))
+        return NULL;
+
+    h = (obf_eval_t *) PyCapsule_GetPointer(py_handle, NULL);
+    if (h == NULL)
+        return NULL;
+
+    obf_eval_set_nodecap(h, nodecap);
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * Sets how many evaluations queued by eval_async on a handle run at once.
+ * obf_eval_set_nthreads guards the handle's pool itself, so other threads may
+ * queue or wait on evaluations while this waits without the GIL.
+ */
+static PyObject *
+obf_eval_set_nthreads_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_handle;
+    obf_eval_t *h;
+    uint64_t nthreads;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "Ol", &py_handle, &nthreads))
+        return NULL;
+
+    h = (obf_eval_t *) PyCapsule_GetPointer(py_handle, NULL);
+    if (h == NULL)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    ret = obf_eval_set_nthreads(h, nthreads);
+    Py_END_ALLOW_THREADS
+    if (ret == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "invalid number of threads");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/*
+ * The result of an evaluation queued by eval_async.  It is filled in by the
+ * handle's pool thread, which never touches Python objects, so no Python code
+ * runs outside of the threads that hold the GIL.  A future dropped before its
+ * evaluation finishes is orphaned and freed by the pool thread instead.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    bool orphaned;
+    int iszero;
+} eval_future_t;
+
+static void eval_future_free(eval_future_t *f);
+
+static void
+eval_future_set(int iszero, void *arg)
+{
+    eval_future_t *f = (eval_future_t *) arg;
+
+    pthread_mutex_lock(&f->lock);
+    if (f->orphaned) {
+        pthread_mutex_unlock(&f->lock);
+        eval_future_free(f);
+        return;
+    }
+    f->iszero = iszero;
+    f->done = true;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void
+eval_future_wait(eval_future_t *f)
+{
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&f->lock);
+    while (!f->done)
+        pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+    Py_END_ALLOW_THREADS
+}
+
+static void
+eval_future_free(eval_future_t *f)
+{
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+static void
+obf_eval_future_clear_wrapper(PyObject *self)
+{
+    eval_future_t *f = (eval_future_t *) PyCapsule_GetPointer(self, NULL);
+    bool done;
+
+    // never block here: destructors may run during finalization, so if the
+    // pool thread has yet to write to f, leave it to free f instead
+    pthread_mutex_lock(&f->lock);
+    done = f->done;
+    if (!done)
+        f->orphaned = true;
+    pthread_mutex_unlock(&f->lock);
+    if (done)
+        eval_future_free(f);
+    // release the handle the evaluation was queued on; closing it does not
+    // wait for the evaluation either
+    Py_XDECREF((PyObject *) PyCapsule_GetContext(self));
+}
+
+/*
+ * Queues an evaluation of an open handle on a single input and returns a
+ * future for its output at once.  The future keeps the handle alive.
+ */
+static PyObject *
+obf_eval_async_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_handle, *py_input, *py_future;
+    obf_eval_t *h;
+    eval_future_t *f;
+    uint64_t *input;
+    uint64_t len, ncores = 0;
+    int ret;
+
+    if (!PyArg_ParseTuple(args, "OOl", &py_handle, &py_input, &ncores))
+        return NULL;
+
+    h = (obf_eval_t *) PyCapsule_GetPointer(py_handle, NULL);
+    if (h == NULL)
+        return NULL;
+
+    len = PyList_Size(py_input);
+    input = (uint64_t *) calloc(len ? len : 1, sizeof(uint64_t));
+    for (uint64_t i = 0; i < len; ++i) {
+        input[i] = PyLong_AsLong(PyList_GetItem(py_input, i));
+    }
+
+    f = (eval_future_t *) calloc(1, sizeof(eval_future_t));
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    ret = obf_eval_async(h, len, input, ncores, eval_future_set, f);
+    free(input);
+    if (ret == OBFUSCATOR_ERR) {
+        eval_future_free(f);
+        PyErr_SetString(PyExc_RuntimeError, "unable to queue evaluation");
+        return NULL;
+    }
+
+    py_future = PyCapsule_New((void *) f, NULL, obf_eval_future_clear_wrapper);
+    Py_INCREF(py_handle);
+    PyCapsule_SetContext(py_future, (void *) py_handle);
+    return py_future;
+}
+
+static PyObject *
+obf_eval_done_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_future;
+    eval_future_t *f;
+    bool done;
+
+    if (!PyArg_ParseTuple(args, "O", &py_future))
+        return NULL;
+
+    f = (eval_future_t *) PyCapsule_GetPointer(py_future, NULL);
+    if (f == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&f->lock);
+    done = f->done;
+    pthread_mutex_unlock(&f->lock);
+    return PyBool_FromLong(done);
+}
+
+/*
+ * Waits for the evaluation behind a future and returns its output.
+ */
+static PyObject *
+obf_eval_result_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_future;
+    eval_future_t *f;
+
+    if (!PyArg_ParseTuple(args, "O", &py_future))
+        return NULL;
+
+    f = (eval_future_t *) PyCapsule_GetPointer(py_future, NULL);
+    if (f == NULL)
+        return NULL;
+
+    eval_future_wait(f);
+    if (f->iszero == -1) {
+        PyErr_SetString(PyExc_RuntimeError, "zero test failed");
+        return NULL;
+    }
+    return Py_BuildValue("i", f->iszero ? 0 : 1);
+}
+
+static void
+obf_session_close_wrapper(PyObject *self)
+{
+    obf_session_close((obf_session_t *) PyCapsule_GetPointer(self, NULL));
+    // release the handle the session was opened on
+    Py_XDECREF((PyObject *) PyCapsule_GetContext(self));
+}
+
+/*
+ * Starts an incremental evaluation session on an open handle at the given
+ * input.  The session keeps the handle alive.
+ */
+static PyObject *
+obf_session_open_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_handle, *py_input, *py_session;
+    obf_eval_t *h;
+    obf_session_t *s;
+    uint64_t *input;
+    uint64_t len, ncores = 0;
+
+    if (!PyArg_ParseTuple(args, "OOl", &py_handle, &py_input, &ncores))
+        return NULL;
+
+    h = (obf_eval_t *) PyCapsule_GetPointer(py_handle, NULL);
+    if (h == NULL)
+        return NULL;
+
+    len = PyList_Size(py_input);
+    input = (uint64_t *) calloc(len, sizeof(uint64_t));
+    for (uint64_t i = 0; i < len; ++i) {
+        input[i] = PyLong_AsLong(PyList_GetItem(py_input, i));
+    }
+    Py_BEGIN_ALLOW_THREADS
+    s = obf_session_open(h, len, input, ncores);
+    Py_END_ALLOW_THREADS
+    free(input);
+    if (s == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to start session");
+        return NULL;
+    }
+
+    py_session = PyCapsule_New((void *) s, NULL, obf_session_close_wrapper);
+    Py_INCREF(py_handle);
+    PyCapsule_SetContext(py_session, (void *) py_handle);
+    return py_session;
+}
+
+/*
+ * Applies a list of (position, value) changes to the input of a session and
+ * returns the output on the new input.
+ */
+static PyObject *
+obf_session_set_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_session, *py_changes;
+    obf_session_t *s;
+    uint64_t *positions, *values;
+    uint64_t nchanges;
+    int iszero;
+
+    if (!PyArg_ParseTuple(args, "OO", &py_session, &py_changes))
+        return NULL;
+
+    s = (obf_session_t *) PyCapsule_GetPointer(py_session, NULL);
+    if (s == NULL)
+        return NULL;
+
+    nchanges = PyList_Size(py_changes);
+    positions = (uint64_t *) calloc(nchanges, sizeof(uint64_t));
+    values = (uint64_t *) calloc(nchanges, sizeof(uint64_t));
+    for (uint64_t i = 0; i < nchanges; ++i) {
+        PyObject *py_change = PyList_GetItem(py_changes, i);
+        if (!PyArg_ParseTuple(py_change, "ll", &positions[i], &values[i])) {
+            free(positions);
+            free(values);
+            return NULL;
+        }
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    iszero = obf_session_set(s, nchanges, positions, values);
+    Py_END_ALLOW_THREADS
+    free(positions);
+    free(values);
+    if (iszero == -1) {
+        PyErr_SetString(PyExc_RuntimeError, "zero test failed");
+        return NULL;
+    }
+    return Py_BuildValue("i", iszero ? 0 : 1);
+}
+
+static PyObject *
+obf_session_result_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_session;
+    obf_session_t *s;
+
+    if (!PyArg_ParseTuple(args, "O", &py_session))
+        return NULL;
+
+    s = (obf_session_t *) PyCapsule_GetPointer(py_session, NULL);
+    if (s == NULL)
+        return NULL;
+
+    return Py_BuildValue("i", obf_session_result(s) ? 0 : 1);
+}
+
+static PyObject *
+obf_container_info_wrapper(PyObject *self, PyObject *args)
+{
+    char *fname = NULL;
+    uint64_t nslots, nlayers;
+
+    if (!PyArg_ParseTuple(args, "s", &fname))
+        return NULL;
+
+    if (obf_container_info(fname, &nslots, &nlayers) == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to read container");
+        return NULL;
+    }
+
+    return Py_BuildValue("(kk)", nslots, nlayers);
+}
+
+static PyObject *
+fmpz_mat_to_py(const fmpz_mat_t m)
+{
+    PyObject *py_m = PyList_New(m->r);
+
+    for (long i = 0; i < m->r; ++i) {
+        PyObject *py_row = PyList_New(m->c);
+        for (long j = 0; j < m->c; ++j) {
+            const fmpz *e = fmpz_mat_entry(m, i, j);
+            PyList_SetItem(py_row, j, fmpz_fits_si(e)
+                           ? PyLong_FromLong(fmpz_get_si(e))
+                           : fmpz_to_py(e));
+        }
+        PyList_SetItem(py_m, i, py_row);
+    }
+    return py_m;
+}
+
+static PyObject *
+obf_sz_compile_wrapper(PyObject *self, PyObject *args)
+{
+    char *fname = NULL, err[256] = "unable to compile formula";
+    obf_bp_layer_t *layers;
+    uint64_t nlayers;
+    PyObject *py_layers;
+
+    if (!PyArg_ParseTuple(args, "s", &fname))
+        return NULL;
+
+    if ((layers = obf_sz_compile(fname, &nlayers, err, sizeof err)) == NULL) {
+        PyErr_SetString(PyExc_RuntimeError, err);
+        return NULL;
+    }
+
+    py_layers = PyList_New(nlayers);
+    for (uint64_t i = 0; i < nlayers; ++i) {
+        PyList_SetItem(py_layers, i,
+                       Py_BuildValue("(l[NN])", layers[i].inp,
+                                     fmpz_mat_to_py(layers[i].mats[0]),
+                                     fmpz_mat_to_py(layers[i].mats[1])));
+    }
+    obf_bp_clear(layers, nlayers);
+
+    return py_layers;
+}
+
+static PyObject *
+obf_set_budget_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_state;
+    obf_state_t *s;
+    uint64_t maxlayers, maxbytes;
+
+    if (!PyArg_ParseTuple(args, "Oll", &py_state, &maxlayers, &maxbytes))
+        return NULL;
+
+    s = (obf_state_t *) PyCapsule_GetPointer(py_state, NULL);
+    if (s == NULL)
+        return NULL;
+
+    obf_set_budget(s, maxlayers, maxbytes);
+
+    Py_RETURN_NONE;
+}
+
 static PyObject *
 obf_wait_wrapper(PyObject *self, PyObject *args)
 {
@@ -169,7 +893,30 @@ obf_wait_wrapper(PyObject *self, PyObject *args)
     if (s == NULL)
         return NULL;
 
+    Py_BEGIN_ALLOW_THREADS
     obf_wait(s);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+obf_checkpoint_remove_wrapper(PyObject *self, PyObject *args)
+{
+    PyObject *py_state;
+    obf_state_t *s;
+
+    if (!PyArg_ParseTuple(args, "O", &py_state))
+        return NULL;
+
+    s = (obf_state_t *) PyCapsule_GetPointer(py_state, NULL);
+    if (s == NULL)
+        return NULL;
+
+    if (obf_checkpoint_remove(s) == OBFUSCATOR_ERR) {
+        PyErr_SetString(PyExc_RuntimeError, "unable to remove checkpoint");
+        return NULL;
+    }
 
     Py_RETURN_NONE;
 }
@@ -180,12 +927,44 @@ ObfMethods[] = {
      "Set up obfuscator."},
     {"encode_layer", obf_encode_layer_wrapper, METH_VARARGS,
      "Encode a branching program layer in each slot."},
+    {"encode_layer_buffers", obf_encode_layer_buffers_wrapper, METH_VARARGS,
+     "Encode a single layer given as int64 buffers."},
     {"max_mem_usage", obf_max_mem_usage, METH_VARARGS,
      "Print out the maximum memory usage."},
     {"evaluate", obf_evaluate_wrapper, METH_VARARGS,
      "Evaluate the obfuscation."},
+    {"randomizer_chain", obf_randomizer_chain_wrapper, METH_VARARGS,
+     "Draw the randomizers for a range of layers up front."},
+    {"set_budget", obf_set_budget_wrapper, METH_VARARGS,
+     "Bound the number and size of layers being encoded at once."},
     {"wait", obf_wait_wrapper, METH_VARARGS,
      "Wait for threadpool to empty."},
+    {"checkpoint_remove", obf_checkpoint_remove_wrapper, METH_VARARGS,
+     "Remove the checkpoint state of a finished obfuscation."},
+    {"eval_open", obf_eval_open_wrapper, METH_VARARGS,
+     "Open a persistent evaluation handle on an obfuscation."},
+    {"eval", obf_eval_wrapper, METH_VARARGS,
+     "Evaluate an open handle on one or more inputs."},
+    {"eval_set_nodecap", obf_eval_set_nodecap_wrapper, METH_VARARGS,
+     "Bound the inputs a batch evaluation of a handle walks at once."},
+    {"eval_set_nthreads", obf_eval_set_nthreads_wrapper, METH_VARARGS,
+     "Set how many queued evaluations of a handle run at once."},
+    {"eval_async", obf_eval_async_wrapper, METH_VARARGS,
+     "Queue an evaluation of an open handle and return a future."},
+    {"eval_done", obf_eval_done_wrapper, METH_VARARGS,
+     "Return whether the evaluation behind a future has finished."},
+    {"eval_result", obf_eval_result_wrapper, METH_VARARGS,
+     "Wait for the evaluation behind a future and return its output."},
+    {"session_open", obf_session_open_wrapper, METH_VARARGS,
+     "Start an incremental evaluation session on an open handle."},
+    {"session_set", obf_session_set_wrapper, METH_VARARGS,
+     "Change input values of a session and re-evaluate."},
+    {"session_result", obf_session_result_wrapper, METH_VARARGS,
+     "Return the output of a session on its current input."},
+    {"container_info", obf_container_info_wrapper, METH_VARARGS,
+     "Return the base and number of layers of a single-file obfuscation."},
+    {"sz_compile", obf_sz_compile_wrapper, METH_VARARGS,
+     "Compile a formula into a branching program."},
     {NULL, NULL, 0, NULL}
 };
 
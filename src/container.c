@@ -0,0 +1,383 @@
+#include "container.h"
+#include "obfuscator.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HEADER_SIZE (8 + 5 * sizeof(uint64_t))
+
+static int
+write_u64(FILE *fp, uint64_t x)
+{
+    return fwrite(&x, sizeof x, 1, fp) == 1 ? OBFUSCATOR_OK : OBFUSCATOR_ERR;
+}
+
+static int
+read_u64(FILE *fp, uint64_t *x)
+{
+    return fread(x, sizeof *x, 1, fp) == 1 ? OBFUSCATOR_OK : OBFUSCATOR_ERR;
+}
+
+static int
+write_header(container_t *c, uint64_t table_offset)
+{
+    if (fseek(c->fp, 0, SEEK_SET) != 0)
+        return OBFUSCATOR_ERR;
+    if (fwrite(CONTAINER_MAGIC, 8, 1, c->fp) != 1)
+        return OBFUSCATOR_ERR;
+    if (write_u64(c->fp, CONTAINER_VERSION) == OBFUSCATOR_ERR
+        || write_u64(c->fp, c->nslots) == OBFUSCATOR_ERR
+        || write_u64(c->fp, c->nlayers) == OBFUSCATOR_ERR
+        || write_u64(c->fp, c->params_offset) == OBFUSCATOR_ERR
+        || write_u64(c->fp, table_offset) == OBFUSCATOR_ERR)
+        return OBFUSCATOR_ERR;
+    return OBFUSCATOR_OK;
+}
+
+/*
+ * Maps the whole container read-only.  Failure is not fatal: reads then fall
+ * back to going through c->fp.
+ */
+static void
+map_container(container_t *c)
+{
+    struct stat st;
+    void *map;
+
+    if (fstat(fileno(c->fp), &st) != 0 || st.st_size == 0)
+        return;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(c->fp), 0);
+    if (map == MAP_FAILED)
+        return;
+    (void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+    c->map = map;
+    c->maplen = st.st_size;
+}
+
+/*
+ * Returns a stream over bytes [offset, offset + length) of the mapping.  The
+ * stream is unbuffered so that the decoder copies straight out of the mapped
+ * pages.
+ */
+static FILE *
+open_mapped_range(container_t *c, uint64_t offset, uint64_t length)
+{
+    FILE *fp;
+    uintptr_t start, end;
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (offset + length > c->maplen || length == 0)
+        return NULL;
+    start = ((uintptr_t) c->map + offset) & ~((uintptr_t) pagesize - 1);
+    end = (uintptr_t) c->map + offset + length;
+    (void) madvise((void *) start, end - start, MADV_WILLNEED);
+    if ((fp = fmemopen((char *) c->map + offset, length, "rb")) == NULL)
+        return NULL;
+    (void) setvbuf(fp, NULL, _IONBF, 0);
+    return fp;
+}
+
+static int
+grow_table(container_t *c, uint64_t nlayers)
+{
+    uint64_t cap;
+    container_layer_t *layers;
+    uint64_t *offsets, *lengths;
+
+    if (nlayers <= c->cap)
+        return OBFUSCATOR_OK;
+    cap = c->cap ? c->cap : 64;
+    while (cap < nlayers)
+        cap *= 2;
+    layers = realloc(c->layers, cap * sizeof c->layers[0]);
+    if (layers == NULL)
+        return OBFUSCATOR_ERR;
+    c->layers = layers;
+    offsets = realloc(c->offsets, cap * c->nslots * sizeof c->offsets[0]);
+    if (offsets == NULL)
+        return OBFUSCATOR_ERR;
+    c->offsets = offsets;
+    lengths = realloc(c->lengths, cap * c->nslots * sizeof c->lengths[0]);
+    if (lengths == NULL)
+        return OBFUSCATOR_ERR;
+    c->lengths = lengths;
+    memset(c->layers + c->cap, '\0', (cap - c->cap) * sizeof c->layers[0]);
+    memset(c->offsets + c->cap * c->nslots, '\0',
+           (cap - c->cap) * c->nslots * sizeof c->offsets[0]);
+    memset(c->lengths + c->cap * c->nslots, '\0',
+           (cap - c->cap) * c->nslots * sizeof c->lengths[0]);
+    c->cap = cap;
+    return OBFUSCATOR_OK;
+}
+
+container_t *
+container_create(const char *fname)
+{
+    container_t *c;
+
+    if ((c = calloc(1, sizeof(container_t))) == NULL)
+        return NULL;
+    if ((c->fp = fopen(fname, "w+b")) == NULL) {
+        fprintf(stderr, "unable to open '%s'\n", fname);
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+    if (write_header(c, 0) == OBFUSCATOR_ERR) {
+        container_close(c);
+        return NULL;
+    }
+    c->end = HEADER_SIZE;
+    c->dirty = 1;
+    return c;
+}
+
+container_t *
+container_open(const char *fname)
+{
+    container_t *c;
+    char magic[8];
+    uint64_t version, nlayers, table_offset;
+
+    if ((c = calloc(1, sizeof(container_t))) == NULL)
+        return NULL;
+    if ((c->fp = fopen(fname, "rb")) == NULL) {
+        fprintf(stderr, "unable to open '%s'\n", fname);
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+
+    if (fread(magic, sizeof magic, 1, c->fp) != 1
+        || memcmp(magic, CONTAINER_MAGIC, sizeof magic) != 0) {
+        fprintf(stderr, "'%s' is not an obfuscation container\n", fname);
+        goto error;
+    }
+    if (read_u64(c->fp, &version) == OBFUSCATOR_ERR
+        || read_u64(c->fp, &c->nslots) == OBFUSCATOR_ERR
+        || read_u64(c->fp, &nlayers) == OBFUSCATOR_ERR
+        || read_u64(c->fp, &c->params_offset) == OBFUSCATOR_ERR
+        || read_u64(c->fp, &table_offset) == OBFUSCATOR_ERR)
+        goto error;
+    if (version != CONTAINER_VERSION) {
+        fprintf(stderr, "unsupported container version %lu\n", version);
+        goto error;
+    }
+    if (table_offset == 0) {
+        fprintf(stderr, "'%s' was not finalized\n", fname);
+        goto error;
+    }
+
+    if (grow_table(c, nlayers) == OBFUSCATOR_ERR)
+        goto error;
+    c->nlayers = nlayers;
+    if (fseek(c->fp, table_offset, SEEK_SET) != 0)
+        goto error;
+    for (uint64_t i = 0; i < nlayers; ++i) {
+        if (read_u64(c->fp, &c->layers[i].inp) == OBFUSCATOR_ERR
+            || read_u64(c->fp, &c->layers[i].nrows) == OBFUSCATOR_ERR
+            || read_u64(c->fp, &c->layers[i].ncols) == OBFUSCATOR_ERR)
+            goto error;
+        for (uint64_t s = 0; s < c->nslots; ++s) {
+            uint64_t k = i * c->nslots + s;
+            if (read_u64(c->fp, &c->offsets[k]) == OBFUSCATOR_ERR
+                || read_u64(c->fp, &c->lengths[k]) == OBFUSCATOR_ERR)
+                goto error;
+        }
+    }
+    c->end = table_offset;
+    map_container(c);
+    return c;
+
+error:
+    container_close(c);
+    return NULL;
+}
+
+void
+container_close(container_t *c)
+{
+    if (c == NULL)
+        return;
+    if (c->dirty)
+        (void) container_finalize(c);
+    if (c->map)
+        (void) munmap(c->map, c->maplen);
+    fclose(c->fp);
+    pthread_mutex_destroy(&c->lock);
+    free(c->layers);
+    free(c->offsets);
+    free(c->lengths);
+    free(c);
+}
+
+int
+container_write_params(container_t *c, const mmap_vtable *vtable,
+                       mmap_ro_pp pp)
+{
+    pthread_mutex_lock(&c->lock);
+    (void) fseek(c->fp, c->end, SEEK_SET);
+    c->params_offset = c->end;
+    vtable->pp->fwrite(pp, c->fp);
+    c->end = ftell(c->fp);
+    c->dirty = 1;
+    pthread_mutex_unlock(&c->lock);
+    return OBFUSCATOR_OK;
+}
+
+int
+container_read_params(container_t *c, const mmap_vtable *vtable, mmap_pp pp)
+{
+    FILE *fp;
+
+    if (c->params_offset == 0)
+        return OBFUSCATOR_ERR;
+    if (c->map) {
+        fp = open_mapped_range(c, c->params_offset,
+                               c->maplen - c->params_offset);
+        if (fp == NULL)
+            return OBFUSCATOR_ERR;
+        vtable->pp->fread(pp, fp);
+        fclose(fp);
+        return OBFUSCATOR_OK;
+    }
+    if (fseek(c->fp, c->params_offset, SEEK_SET) != 0)
+        return OBFUSCATOR_ERR;
+    vtable->pp->fread(pp, c->fp);
+    return OBFUSCATOR_OK;
+}
+
+int
+container_write_layer(container_t *c, uint64_t idx, uint64_t inp,
+                      uint64_t nrows, uint64_t ncols, uint64_t n,
+                      char *const *bufs, const size_t *lens)
+{
+    int ret = OBFUSCATOR_ERR;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->nslots == 0) {
+        c->nslots = n;
+    } else if (c->nslots != n) {
+        fprintf(stderr, "layer %lu: expected %lu slots, got %lu\n", idx,
+                c->nslots, n);
+        goto done;
+    }
+    if (grow_table(c, idx + 1) == OBFUSCATOR_ERR)
+        goto done;
+    if (fseek(c->fp, c->end, SEEK_SET) != 0)
+        goto done;
+    for (uint64_t s = 0; s < n; ++s) {
+        if (fwrite(bufs[s], 1, lens[s], c->fp) != lens[s])
+            goto done;
+        c->offsets[idx * n + s] = c->end;
+        c->lengths[idx * n + s] = lens[s];
+        c->end += lens[s];
+    }
+    c->layers[idx].inp = inp;
+    c->layers[idx].nrows = nrows;
+    c->layers[idx].ncols = ncols;
+    if (idx + 1 > c->nlayers)
+        c->nlayers = idx + 1;
+    c->dirty = 1;
+    ret = OBFUSCATOR_OK;
+done:
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+int
+container_finalize(container_t *c)
+{
+    int ret = OBFUSCATOR_ERR;
+
+    pthread_mutex_lock(&c->lock);
+    if (fseek(c->fp, c->end, SEEK_SET) != 0)
+        goto done;
+    for (uint64_t i = 0; i < c->nlayers; ++i) {
+        if (c->layers[i].nrows == 0)
+            fprintf(stderr, "warning: layer %lu missing from container\n", i);
+        if (write_u64(c->fp, c->layers[i].inp) == OBFUSCATOR_ERR
+            || write_u64(c->fp, c->layers[i].nrows) == OBFUSCATOR_ERR
+            || write_u64(c->fp, c->layers[i].ncols) == OBFUSCATOR_ERR)
+            goto done;
+        for (uint64_t s = 0; s < c->nslots; ++s) {
+            uint64_t k = i * c->nslots + s;
+            if (write_u64(c->fp, c->offsets[k]) == OBFUSCATOR_ERR
+                || write_u64(c->fp, c->lengths[k]) == OBFUSCATOR_ERR)
+                goto done;
+        }
+    }
+    if (write_header(c, c->end) == OBFUSCATOR_ERR)
+        goto done;
+    if (fflush(c->fp) != 0)
+        goto done;
+    c->dirty = 0;
+    ret = OBFUSCATOR_OK;
+done:
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+int
+container_layer_info(const container_t *c, uint64_t layer, uint64_t *inp,
+                     uint64_t *nrows, uint64_t *ncols)
+{
+    if (layer >= c->nlayers || c->layers[layer].nrows == 0) {
+        fprintf(stderr, "layer %lu missing from container\n", layer);
+        return OBFUSCATOR_ERR;
+    }
+    *inp = c->layers[layer].inp;
+    *nrows = c->layers[layer].nrows;
+    *ncols = c->layers[layer].ncols;
+    return OBFUSCATOR_OK;
+}
+
+FILE *
+container_open_matrix(container_t *c, uint64_t layer, uint64_t slot)
+{
+    uint64_t k;
+
+    if (layer >= c->nlayers || slot >= c->nslots)
+        return NULL;
+    k = layer * c->nslots + slot;
+    if (c->map)
+        return open_mapped_range(c, c->offsets[k], c->lengths[k]);
+    if (fseek(c->fp, c->offsets[k], SEEK_SET) != 0)
+        return NULL;
+    return c->fp;
+}
+
+/* Asks the kernel to start reading matrix (layer, slot) in the background. */
+void
+container_readahead(container_t *c, uint64_t layer, uint64_t slot)
+{
+    uint64_t k;
+    uintptr_t start, end;
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (layer >= c->nlayers || slot >= c->nslots)
+        return;
+    k = layer * c->nslots + slot;
+    if (c->map) {
+        if (c->offsets[k] + c->lengths[k] > c->maplen)
+            return;
+        start = ((uintptr_t) c->map + c->offsets[k])
+            & ~((uintptr_t) pagesize - 1);
+        end = (uintptr_t) c->map + c->offsets[k] + c->lengths[k];
+        (void) madvise((void *) start, end - start, MADV_WILLNEED);
+    } else {
+        (void) posix_fadvise(fileno(c->fp), c->offsets[k], c->lengths[k],
+                             POSIX_FADV_WILLNEED);
+    }
+}
+
+void
+container_close_matrix(container_t *c, FILE *fp)
+{
+    if (fp != c->fp)
+        fclose(fp);
+}
@@ -0,0 +1,91 @@
+#ifndef __OBFUSCATION__CONTAINER_H__
+#define __OBFUSCATION__CONTAINER_H__
+
+/*
+ * Single-file obfuscation container.
+ *
+ * Layout (all integers are native-endian uint64_t, as elsewhere in libobf):
+ *
+ *   header:  magic, version, nslots, nlayers, params offset, table offset
+ *   params:  the serialized public parameters
+ *   data:    the encodings of each (layer, slot) matrix, row-major, stored
+ *            contiguously in the order the layers finished encoding
+ *   table:   for each layer, its input bit, nrows, ncols and the (offset,
+ *            length) of each slot matrix
+ *
+ * The table lives at the end of the file so that layers can be appended as
+ * they finish; the header is rewritten on container_finalize().
+ *
+ * Containers opened for reading are memory-mapped, and encodings are decoded
+ * straight out of the mapped pages.
+ */
+
+#include <mmap/mmap.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CONTAINER_MAGIC "LIBOBF\x00\x01"
+#define CONTAINER_VERSION 1
+
+typedef struct {
+    uint64_t inp;
+    uint64_t nrows;
+    uint64_t ncols;
+} container_layer_t;
+
+typedef struct container_s {
+    FILE *fp;
+    void *map;
+    size_t maplen;
+    pthread_mutex_t lock;
+    uint64_t nslots;
+    uint64_t nlayers;
+    uint64_t cap;
+    uint64_t params_offset;
+    uint64_t end;
+    container_layer_t *layers;
+    uint64_t *offsets;          /* nlayers x nslots */
+    uint64_t *lengths;          /* nlayers x nslots */
+    int dirty;
+} container_t;
+
+container_t *
+container_create(const char *fname);
+
+container_t *
+container_open(const char *fname);
+
+void
+container_close(container_t *c);
+
+int
+container_write_params(container_t *c, const mmap_vtable *vtable,
+                       mmap_ro_pp pp);
+
+int
+container_read_params(container_t *c, const mmap_vtable *vtable, mmap_pp pp);
+
+/* Appends a layer given the serialized encodings of each slot's matrix */
+int
+container_write_layer(container_t *c, uint64_t idx, uint64_t inp,
+                      uint64_t nrows, uint64_t ncols, uint64_t n,
+                      char *const *bufs, const size_t *lens);
+
+int
+container_finalize(container_t *c);
+
+int
+container_layer_info(const container_t *c, uint64_t layer, uint64_t *inp,
+                     uint64_t *nrows, uint64_t *ncols);
+
+FILE *
+container_open_matrix(container_t *c, uint64_t layer, uint64_t slot);
+
+void
+container_readahead(container_t *c, uint64_t layer, uint64_t slot);
+
+void
+container_close_matrix(container_t *c, FILE *fp);
+
+#endif
@@ -0,0 +1,1833 @@
+#include "obfuscator.h"
+#include "container.h"
+#include "thpool.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <omp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static mmap_enc **
+enc_vec_init(const mmap_vtable *vtable, mmap_ro_pp pp, uint64_t n)
+{
+    mmap_enc **v;
+
+    v = calloc(n, sizeof(mmap_enc *));
+    for (uint64_t i = 0; i < n; ++i) {
+        v[i] = malloc(vtable->enc->size);
+        vtable->enc->init(v[i], pp);
+    }
+    return v;
+}
+
+static void
+enc_vec_clear(const mmap_vtable *vtable, mmap_enc **v, uint64_t n)
+{
+    if (v == NULL)
+        return;
+    for (uint64_t i = 0; i < n; ++i) {
+        vtable->enc->clear(v[i]);
+        free(v[i]);
+    }
+    free(v);
+}
+
+static int
+read_layer_info(const char *dir, container_t *c, uint64_t layer,
+                uint64_t *inp, uint64_t *nrows, uint64_t *ncols)
+{
+    FILE *fp;
+
+    if (c)
+        return container_layer_info(c, layer, inp, nrows, ncols);
+
+    if ((fp = open_indexed_file(dir, "nrows", layer, "r+b")) == NULL)
+        return OBFUSCATOR_ERR;
+    fread(nrows, sizeof *nrows, 1, fp);
+    fclose(fp);
+    if ((fp = open_indexed_file(dir, "ncols", layer, "r+b")) == NULL)
+        return OBFUSCATOR_ERR;
+    fread(ncols, sizeof *ncols, 1, fp);
+    fclose(fp);
+    if ((fp = open_indexed_file(dir, "input", layer, "r+b")) == NULL)
+        return OBFUSCATOR_ERR;
+    fread(inp, sizeof *inp, 1, fp);
+    fclose(fp);
+    return OBFUSCATOR_OK;
+}
+
+static FILE *
+open_layer_matrix(const char *dir, container_t *c, uint64_t layer,
+                  uint64_t slot)
+{
+    char str[10];
+
+    if (c)
+        return container_open_matrix(c, layer, slot);
+    (void) snprintf(str, 10, "%lu", slot);
+    return open_indexed_file(dir, str, layer, "r+b");
+}
+
+static void
+close_layer_matrix(container_t *c, FILE *fp)
+{
+    if (c)
+        container_close_matrix(c, fp);
+    else
+        fclose(fp);
+}
+
+static container_t *
+open_container_if_file(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+        return container_open(path);
+    return NULL;
+}
+
+/*
+ * Loads the public parameters of the obfuscation at `dir`, which is either a
+ * directory or a single-file container.  In the latter case the opened
+ * container is returned in *c, otherwise *c is set to NULL.
+ */
+static mmap_pp
+load_params(const mmap_vtable *vtable, const char *dir, container_t **c)
+{
+    mmap_pp pp;
+    FILE *fp;
+
+    if ((pp = malloc(vtable->pp->size)) == NULL)
+        return NULL;
+    *c = open_container_if_file(dir);
+    if (*c) {
+        if (container_read_params(*c, vtable, pp) == OBFUSCATOR_ERR) {
+            container_close(*c);
+            *c = NULL;
+            free(pp);
+            return NULL;
+        }
+    } else {
+        if ((fp = open_file(dir, "params", "r+b")) == NULL) {
+            free(pp);
+            return NULL;
+        }
+        vtable->pp->fread(pp, fp);
+        fclose(fp);
+    }
+    return pp;
+}
+
+/* The entry of the final product that gets zero-tested */
+static inline long
+zero_test_col(uint64_t nrows_first, uint64_t ncols_last)
+{
+    return (nrows_first == 1 && ncols_last == 1) ? 0 : 1;
+}
+
+/*
+ * Computes w = v * M for the nrows x ncols top-left corner M of a matrix
+ * already in memory, using tmp[j] as scratch space for column j.  If col >=
+ * 0, only entry w[col] is computed.
+ */
+static void
+enc_vec_mul_mat(const mmap_vtable *vtable, mmap_ro_pp pp, mmap_enc **w,
+                mmap_enc **v, const mmap_enc_mat_struct *m, uint64_t nrows,
+                uint64_t ncols, mmap_enc **tmp, long col)
+{
+#pragma omp parallel for
+    for (uint64_t j = 0; j < ncols; ++j) {
+        if (col >= 0 && j != (uint64_t) col)
+            continue;
+        for (uint64_t i = 0; i < nrows; ++i) {
+            vtable->enc->mul(tmp[j], pp, v[i], m->m[i][j]);
+            if (i == 0)
+                vtable->enc->set(w[j], tmp[j]);
+            else
+                vtable->enc->add(w[j], pp, w[j], tmp[j]);
+        }
+    }
+}
+
+/*
+ * Layer prefetching.
+ *
+ * While the evaluator multiplies in layer k, a background thread reads and
+ * deserializes layers k + 1 .. k + PREFETCH_DEPTH into a ring of buffers, and
+ * asks the kernel to read ahead the matrix after those.  When the obfuscation
+ * is not in the page cache, evaluation then takes about the larger of the I/O
+ * and compute times rather than their sum.
+ *
+ * The ring buffers are allocated once, at the largest layer dimensions, and
+ * each layer is read into the top-left corner of one of them, whose extent is
+ * kept alongside the buffer.
+ */
+
+#define PREFETCH_DEPTH 2
+#define PREFETCH_NBUFS (PREFETCH_DEPTH + 1)
+
+typedef struct {
+    mmap_enc_mat_t mat;         /* maxrows x maxcols */
+    uint64_t nrows;             /* extent of the layer held in mat */
+    uint64_t ncols;
+    int err;
+} prefetch_buf_t;
+
+typedef struct {
+    const mmap_vtable *vtable;
+    mmap_ro_pp pp;
+    container_t *c;
+    const char *dir;
+    const uint64_t *input;
+    uint64_t bplen;
+    uint64_t *inps;
+    uint64_t *nrows;
+    uint64_t *ncols;
+    uint64_t maxrows;
+    uint64_t maxcols;
+    prefetch_buf_t bufs[PREFETCH_NBUFS];
+    uint64_t nread;             /* layers read so far */
+    uint64_t nreleased;         /* layers the evaluator is done with */
+    bool stop;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} prefetch_t;
+
+static void
+prefetch_readahead(prefetch_t *pf, uint64_t layer)
+{
+    uint64_t slot;
+    FILE *fp;
+
+    if (layer >= pf->bplen)
+        return;
+    slot = pf->input[pf->inps[layer]];
+    if (pf->c) {
+        container_readahead(pf->c, layer, slot);
+    } else if ((fp = open_layer_matrix(pf->dir, NULL, layer, slot)) != NULL) {
+        (void) posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_WILLNEED);
+        fclose(fp);
+    }
+}
+
+/* Reads layer into buf.  Only the first row of the first layer is needed. */
+static int
+prefetch_read(prefetch_t *pf, uint64_t layer, prefetch_buf_t *buf)
+{
+    const mmap_vtable *vtable = pf->vtable;
+    uint64_t slot = pf->input[pf->inps[layer]];
+    FILE *fp;
+
+    if ((fp = open_layer_matrix(pf->dir, pf->c, layer, slot)) == NULL) {
+        fprintf(stderr, "layer %lu: unable to open matrix %lu\n", layer,
+                slot);
+        return OBFUSCATOR_ERR;
+    }
+    buf->nrows = layer == 0 ? 1 : pf->nrows[layer];
+    buf->ncols = pf->ncols[layer];
+    for (uint64_t i = 0; i < buf->nrows; ++i) {
+        for (uint64_t j = 0; j < buf->ncols; ++j) {
+            vtable->enc->fread(buf->mat->m[i][j], fp);
+        }
+    }
+    close_layer_matrix(pf->c, fp);
+    return OBFUSCATOR_OK;
+}
+
+static void *
+prefetch_thread(void *arg)
+{
+    prefetch_t *pf = arg;
+
+    for (uint64_t layer = 0; layer < pf->bplen; ++layer) {
+        prefetch_buf_t *buf = &pf->bufs[layer % PREFETCH_NBUFS];
+
+        pthread_mutex_lock(&pf->lock);
+        while (!pf->stop && layer - pf->nreleased >= PREFETCH_NBUFS)
+            pthread_cond_wait(&pf->cond, &pf->lock);
+        pthread_mutex_unlock(&pf->lock);
+        if (pf->stop)
+            break;
+
+        prefetch_readahead(pf, layer + PREFETCH_DEPTH);
+        buf->err = prefetch_read(pf, layer, buf);
+
+        pthread_mutex_lock(&pf->lock);
+        pf->nread++;
+        pthread_cond_broadcast(&pf->cond);
+        pthread_mutex_unlock(&pf->lock);
+        if (buf->err == OBFUSCATOR_ERR)
+            break;
+    }
+    return NULL;
+}
+
+static void
+prefetch_free(prefetch_t *pf)
+{
+    for (int k = 0; k < PREFETCH_NBUFS; ++k) {
+        if (pf->bufs[k].mat->m == NULL)
+            continue;
+        mmap_enc_mat_clear(pf->vtable, pf->bufs[k].mat);
+    }
+    free(pf->inps);
+    free(pf->nrows);
+    free(pf->ncols);
+}
+
+/*
+ * Reads the layer metadata, checks it against the input and starts the
+ * prefetch thread.
+ */
+static int
+prefetch_start(prefetch_t *pf, const mmap_vtable *vtable, mmap_ro_pp pp,
+               container_t *c, const char *dir, uint64_t len,
+               const uint64_t *input, uint64_t bplen)
+{
+    memset(pf, 0, sizeof(prefetch_t));
+    pf->vtable = vtable;
+    pf->pp = pp;
+    pf->c = c;
+    pf->dir = dir;
+    pf->input = input;
+    pf->bplen = bplen;
+    pf->inps = calloc(bplen, sizeof(uint64_t));
+    pf->nrows = calloc(bplen, sizeof(uint64_t));
+    pf->ncols = calloc(bplen, sizeof(uint64_t));
+
+    for (uint64_t layer = 0; layer < bplen; ++layer) {
+        if (read_layer_info(dir, c, layer, &pf->inps[layer],
+                            &pf->nrows[layer], &pf->ncols[layer])
+            == OBFUSCATOR_ERR)
+            goto error;
+        if (pf->inps[layer] >= len) {
+            fprintf(stderr, "invalid input: %lu >= %lu\n", pf->inps[layer],
+                    len);
+            goto error;
+        }
+        if (layer > 0 && pf->nrows[layer] != pf->ncols[layer - 1]) {
+            fprintf(stderr, "layer %lu: dimension mismatch (%lu != %lu)\n",
+                    layer, pf->nrows[layer], pf->ncols[layer - 1]);
+            goto error;
+        }
+        if (layer > 0 && pf->nrows[layer] > pf->maxrows)
+            pf->maxrows = pf->nrows[layer];
+        if (pf->ncols[layer] > pf->maxcols)
+            pf->maxcols = pf->ncols[layer];
+    }
+    if (pf->maxrows == 0)
+        pf->maxrows = 1;
+
+    for (int k = 0; k < PREFETCH_NBUFS && k < (int) bplen; ++k)
+        mmap_enc_mat_init(vtable, pp, pf->bufs[k].mat, pf->maxrows,
+                          pf->maxcols);
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    for (uint64_t layer = 0; layer < PREFETCH_DEPTH; ++layer)
+        prefetch_readahead(pf, layer);
+    if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->cond);
+        goto error;
+    }
+    return OBFUSCATOR_OK;
+
+error:
+    prefetch_free(pf);
+    return OBFUSCATOR_ERR;
+}
+
+/* Waits for `layer` to be read, returning NULL if reading it failed. */
+static prefetch_buf_t *
+prefetch_wait(prefetch_t *pf, uint64_t layer)
+{
+    prefetch_buf_t *buf = &pf->bufs[layer % PREFETCH_NBUFS];
+
+    pthread_mutex_lock(&pf->lock);
+    while (pf->nread <= layer)
+        pthread_cond_wait(&pf->cond, &pf->lock);
+    pthread_mutex_unlock(&pf->lock);
+    return buf->err == OBFUSCATOR_ERR ? NULL : buf;
+}
+
+static void
+prefetch_release(prefetch_t *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->nreleased++;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+static void
+prefetch_stop(prefetch_t *pf)
+{
+    pthread_mutex_lock(&pf->lock);
+    pf->stop = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->lock);
+    pthread_join(pf->thread, NULL);
+    pthread_mutex_destroy(&pf->lock);
+    pthread_cond_destroy(&pf->cond);
+    prefetch_free(pf);
+}
+
+/*
+ * Tree evaluation.
+ *
+ * Matrix products are associative, so the product of the selected matrices
+ * M_0 ... M_{n-1} can be split into subproducts that are computed
+ * concurrently.  Leaf t is a d[t] x d[t+1] matrix, where M_0 is cut down to
+ * its first row and M_{n-1} to the zero-tested column, so d[0] = d[n] = 1.
+ *
+ * The leaves are grouped into at most CHAIN_MAX_RUNS runs of consecutive
+ * leaves, each multiplied out left to right, and the runs are combined in the
+ * order found by the usual matrix-chain dynamic program.  A parenthesization
+ * is scored by its estimated running time on ncores cores, work / ncores +
+ * span, rather than by its work alone, so long programs get a near-balanced
+ * tree of runs while the run holding the row vector M_0 stays a cheap chain
+ * of vector-matrix products.  Bounding the number of runs keeps the program
+ * at a fixed size however many layers there are; programs of at most
+ * CHAIN_MAX_RUNS layers get one leaf per run, as in the plain program.
+ */
+
+#define CHAIN_MAX_RUNS 64
+
+typedef struct {
+    double work;                /* encoding multiplications */
+    double span;                /* multiplications on the critical path */
+    uint64_t split;             /* last run of the left subproduct */
+} chain_cost_t;
+
+typedef struct {
+    uint64_t nruns;
+    uint64_t *first;            /* first leaf of each run, then n */
+    chain_cost_t *cost;         /* nruns x nruns */
+} chain_plan_t;
+
+static void
+chain_plan_clear(chain_plan_t *plan)
+{
+    free(plan->first);
+    free(plan->cost);
+}
+
+static int
+chain_order(chain_plan_t *plan, const uint64_t *d, uint64_t n,
+            uint64_t ncores)
+{
+    uint64_t m = n < CHAIN_MAX_RUNS ? n : CHAIN_MAX_RUNS;
+    chain_cost_t *cost;
+    uint64_t *first;
+
+    plan->nruns = m;
+    plan->first = first = calloc(m + 1, sizeof(uint64_t));
+    plan->cost = cost = calloc(m * m, sizeof(chain_cost_t));
+    if (first == NULL || cost == NULL) {
+        chain_plan_clear(plan);
+        return OBFUSCATOR_ERR;
+    }
+    for (uint64_t t = 0; t <= m; ++t)
+        first[t] = t * n / m;
+
+    // each run is multiplied out left to right
+    for (uint64_t t = 0; t < m; ++t) {
+        for (uint64_t k = first[t] + 1; k < first[t + 1]; ++k) {
+            cost[t * m + t].work +=
+                (double) d[first[t]] * (double) d[k] * (double) d[k + 1];
+            cost[t * m + t].span += d[k];
+        }
+    }
+    for (uint64_t len = 2; len <= m; ++len) {
+        for (uint64_t i = 0; i + len <= m; ++i) {
+            uint64_t j = i + len - 1;
+            chain_cost_t *best = &cost[i * m + j];
+            double score = 0.0;
+
+            for (uint64_t k = i; k < j; ++k) {
+                const chain_cost_t *l = &cost[i * m + k];
+                const chain_cost_t *r = &cost[(k + 1) * m + j];
+                double work, span, s, inner = d[first[k + 1]];
+
+                work = l->work + r->work
+                    + (double) d[first[i]] * inner * (double) d[first[j + 1]];
+                span = (l->span > r->span ? l->span : r->span) + inner;
+                s = work / ncores + span;
+                if (k == i || s < score) {
+                    score = s;
+                    best->work = work;
+                    best->span = span;
+                    best->split = k;
+                }
+            }
+        }
+    }
+    return OBFUSCATOR_OK;
+}
+
+/*
+ * Computes d = l * r, with one task per entry of d.  Must be called from
+ * within an OpenMP parallel region.
+ */
+static void
+enc_mat_mul_tasks(const mmap_vtable *vtable, mmap_ro_pp pp,
+                  mmap_enc_mat_struct *d, const mmap_enc_mat_struct *l,
+                  const mmap_enc_mat_struct *r)
+{
+#pragma omp taskloop
+    for (int e = 0; e < d->nrows * d->ncols; ++e) {
+        int a = e / d->ncols, b = e % d->ncols;
+        mmap_enc *tmp = malloc(vtable->enc->size);
+
+        vtable->enc->init(tmp, pp);
+        for (int x = 0; x < l->ncols; ++x) {
+            vtable->enc->mul(tmp, pp, l->m[a][x], r->m[x][b]);
+            if (x == 0)
+                vtable->enc->set(d->m[a][b], tmp);
+            else
+                vtable->enc->add(d->m[a][b], pp, d->m[a][b], tmp);
+        }
+        vtable->enc->clear(tmp);
+        free(tmp);
+    }
+}
+
+/* Multiplies l by r into a new matrix, freeing l unless it is a leaf. */
+static mmap_enc_mat_struct *
+tree_mul(const mmap_vtable *vtable, mmap_ro_pp pp, mmap_enc_mat_struct *l,
+         bool leaf, const mmap_enc_mat_struct *r)
+{
+    mmap_enc_mat_struct *d;
+
+    d = malloc(sizeof(mmap_enc_mat_struct));
+    mmap_enc_mat_init(vtable, pp, d, l->nrows, r->ncols);
+    enc_mat_mul_tasks(vtable, pp, d, l, r);
+    if (!leaf) {
+        mmap_enc_mat_clear(vtable, l);
+        free(l);
+    }
+    return d;
+}
+
+/*
+ * Computes the product of runs i..j as ordered by `plan`.  The two halves are
+ * computed as concurrent tasks and the entries of each product in parallel.
+ * A product of a single leaf is returned as is; intermediate products are
+ * owned by the caller.
+ */
+static mmap_enc_mat_struct *
+tree_product(const mmap_vtable *vtable, mmap_ro_pp pp,
+             mmap_enc_mat_struct **leaves, const chain_plan_t *plan,
+             uint64_t i, uint64_t j)
+{
+    const uint64_t *first = plan->first;
+    mmap_enc_mat_struct *l, *r, *d;
+    uint64_t k;
+
+    if (i == j) {
+        d = leaves[first[i]];
+        for (k = first[i] + 1; k < first[i + 1]; ++k)
+            d = tree_mul(vtable, pp, d, k == first[i] + 1, leaves[k]);
+        return d;
+    }
+    k = plan->cost[i * plan->nruns + j].split;
+#pragma omp task shared(l)
+    l = tree_product(vtable, pp, leaves, plan, i, k);
+    r = tree_product(vtable, pp, leaves, plan, k + 1, j);
+#pragma omp taskwait
+
+    d = tree_mul(vtable, pp, l, first[k + 1] - first[i] == 1, r);
+    if (first[j + 1] - first[k + 1] > 1) {
+        mmap_enc_mat_clear(vtable, r);
+        free(r);
+    }
+    return d;
+}
+
+/* Multiplies out the n >= 2 leaves, whose product is 1 x 1, and zero-tests
+ * the result, or returns -1 if out of memory. */
+static int
+eval_tree(const mmap_vtable *vtable, mmap_ro_pp pp,
+          mmap_enc_mat_struct **leaves, uint64_t n, uint64_t ncores)
+{
+    mmap_enc_mat_struct *prod;
+    chain_plan_t plan;
+    uint64_t *d;
+    int iszero;
+
+    if ((d = calloc(n + 1, sizeof(uint64_t))) == NULL)
+        return -1;
+    for (uint64_t t = 0; t < n; ++t)
+        d[t] = leaves[t]->nrows;
+    d[n] = leaves[n - 1]->ncols;
+    if (chain_order(&plan, d, n, ncores) == OBFUSCATOR_ERR) {
+        free(d);
+        return -1;
+    }
+
+#pragma omp parallel
+#pragma omp single
+    prod = tree_product(vtable, pp, leaves, &plan, 0, plan.nruns - 1);
+
+    iszero = vtable->enc->is_zero(prod->m[0][0], pp);
+    mmap_enc_mat_clear(vtable, prod);
+    free(prod);
+    chain_plan_clear(&plan);
+    free(d);
+    return iszero;
+}
+
+/*
+ * Evaluates the obfuscation with a tree of concurrent matrix products.  Unlike
+ * the streaming evaluation in obf_evaluate, this holds the selected matrix of
+ * every layer in memory at once.
+ */
+static int
+evaluate_tree(const mmap_vtable *vtable, mmap_ro_pp pp, container_t *c,
+              const char *dir, uint64_t len, uint64_t *input, uint64_t bplen,
+              uint64_t ncores, bool verbose)
+{
+    mmap_enc_mat_struct **leaves;
+    mmap_enc *skip;
+    uint64_t nrows, ncols, inp, nrows_first = 0, vlen = 0;
+    int iszero = -1;
+    double start, end;
+
+    leaves = calloc(bplen, sizeof(mmap_enc_mat_struct *));
+    skip = malloc(vtable->enc->size);
+    vtable->enc->init(skip, pp);
+
+    start = current_time();
+    for (uint64_t layer = 0; layer < bplen; ++layer) {
+        uint64_t r1, c0 = 0, c1;
+        FILE *fp;
+
+        if (read_layer_info(dir, c, layer, &inp, &nrows, &ncols)
+            == OBFUSCATOR_ERR)
+            goto done;
+        if (inp >= len) {
+            fprintf(stderr, "invalid input: %lu >= %lu\n", inp, len);
+            goto done;
+        }
+        if (layer > 0 && nrows != vlen) {
+            fprintf(stderr, "layer %lu: dimension mismatch (%lu != %lu)\n",
+                    layer, nrows, vlen);
+            goto done;
+        }
+        vlen = c1 = ncols;
+        r1 = nrows;
+        if (layer == 0) {
+            nrows_first = nrows;
+            r1 = 1;
+        } else if (layer == bplen - 1) {
+            c0 = zero_test_col(nrows_first, ncols);
+            if (c0 >= ncols) {
+                fprintf(stderr, "layer %lu: too few columns\n", layer);
+                goto done;
+            }
+            c1 = c0 + 1;
+        }
+        if ((fp = open_layer_matrix(dir, c, layer, input[inp])) == NULL) {
+            fprintf(stderr, "layer %lu: unable to open matrix %lu\n", layer,
+                    input[inp]);
+            goto done;
+        }
+        leaves[layer] = malloc(sizeof(mmap_enc_mat_struct));
+        mmap_enc_mat_init(vtable, pp, leaves[layer], r1, c1 - c0);
+        for (uint64_t i = 0; i < r1; ++i) {
+            for (uint64_t j = 0; j < ncols; ++j) {
+                if (j >= c0 && j < c1)
+                    vtable->enc->fread(leaves[layer]->m[i][j - c0], fp);
+                else
+                    vtable->enc->fread(skip, fp);
+            }
+        }
+        close_layer_matrix(c, fp);
+    }
+    end = current_time();
+    if (verbose)
+        (void) fprintf(stderr, "  Loading matrices: %f\n", end - start);
+
+    start = current_time();
+    iszero = eval_tree(vtable, pp, leaves, bplen, ncores);
+    end = current_time();
+    if (verbose)
+        (void) fprintf(stderr, "  Multiplying matrices (%lu cores): %f\n",
+                       ncores, end - start);
+
+done:
+    for (uint64_t layer = 0; layer < bplen; ++layer) {
+        if (leaves[layer]) {
+            mmap_enc_mat_clear(vtable, leaves[layer]);
+            free(leaves[layer]);
+        }
+    }
+    free(leaves);
+    vtable->enc->clear(skip);
+    free(skip);
+    return iszero;
+}
+
+/*
+ * Evaluates the obfuscation by carrying only the first row of the product
+ * through the layers, as the zero test only ever looks at entry (0, 0) or (0,
+ * 1).  This makes each layer a vector-matrix product rather than a full matrix
+ * product.  Layers are read ahead of the multiplication by a prefetch thread,
+ * and the row vector ping-pongs between two buffers of the largest layer
+ * width, so no encodings are allocated per layer.  With more than one core,
+ * the layers are instead multiplied out as a tree (see evaluate_tree).
+ */
+int
+obf_evaluate(enum mmap_e type, char *dir, uint64_t len, uint64_t *input,
+             uint64_t bplen, uint64_t ncores, bool verbose)
+{
+    const mmap_vtable *vtable;
+    mmap_pp pp;
+    container_t *c;
+    prefetch_t pf;
+    prefetch_buf_t *buf;
+    mmap_enc **v = NULL, **w = NULL, **tmp = NULL, **swap;
+    uint64_t maxcols = 0;
+    int iszero = -1;
+    long col;
+    double start, end;
+
+    if ((vtable = get_vtable(type)) == NULL || bplen == 0)
+        return iszero;
+    if (ncores > 0)
+        omp_set_num_threads(ncores);
+    if ((pp = load_params(vtable, dir, &c)) == NULL)
+        return iszero;
+    if (ncores > 1 && bplen > 1) {
+        iszero = evaluate_tree(vtable, pp, c, dir, len, input, bplen, ncores,
+                               verbose);
+        goto cleanup;
+    }
+    if (prefetch_start(&pf, vtable, pp, c, dir, len, input, bplen)
+        == OBFUSCATOR_ERR)
+        goto cleanup;
+
+    // only one entry of the final product is zero-tested
+    col = zero_test_col(pf.nrows[0], pf.ncols[bplen - 1]);
+    if ((uint64_t) col >= pf.ncols[bplen - 1]) {
+        fprintf(stderr, "layer %lu: too few columns\n", bplen - 1);
+        goto done;
+    }
+    maxcols = pf.maxcols;
+    v = enc_vec_init(vtable, pp, maxcols);
+    w = enc_vec_init(vtable, pp, maxcols);
+    tmp = enc_vec_init(vtable, pp, maxcols);
+
+    for (uint64_t layer = 0; layer < bplen; ++layer) {
+        start = current_time();
+        if ((buf = prefetch_wait(&pf, layer)) == NULL)
+            goto done;
+        end = current_time();
+        if (verbose)
+            (void) fprintf(stderr, "  Waiting for layer %lu: %f\n", layer,
+                           end - start);
+
+        start = current_time();
+        if (layer == 0) {
+            for (uint64_t j = 0; j < buf->ncols; ++j)
+                vtable->enc->set(v[j], buf->mat->m[0][j]);
+        } else {
+            enc_vec_mul_mat(vtable, pp, w, v, buf->mat, buf->nrows,
+                            buf->ncols, tmp, layer == bplen - 1 ? col : -1);
+            swap = v;
+            v = w;
+            w = swap;
+        }
+        prefetch_release(&pf);
+        end = current_time();
+
+        if (verbose && layer != 0)
+            (void) fprintf(stderr, "  Multiplying matrices: %f\n", end - start);
+    }
+
+    start = current_time();
+    iszero = vtable->enc->is_zero(v[col], pp);
+    end = current_time();
+    if (verbose)
+        (void) fprintf(stderr, "  Zero test: %f\n", end - start);
+
+done:
+    prefetch_stop(&pf);
+cleanup:
+    enc_vec_clear(vtable, v, maxcols);
+    enc_vec_clear(vtable, w, maxcols);
+    enc_vec_clear(vtable, tmp, maxcols);
+    vtable->pp->clear(pp);
+    free(pp);
+    container_close(c);
+
+    return iszero;
+}
+
+/*
+ * Persistent evaluation handles.
+ *
+ * A handle keeps the public parameters, the layer metadata and the decoded
+ * matrices of the obfuscation resident across evaluations.  Matrices are kept
+ * in a cache indexed by (layer, slot) and, if memcap is nonzero, evicted in
+ * least-recently-used order once their total serialized size exceeds memcap.
+ * Matrices in use by an evaluation are pinned and never evicted.
+ */
+
+/* Inputs per trie walk unless set with obf_eval_set_nodecap */
+#define EVAL_DEFAULT_NODECAP 256
+
+typedef struct {
+    mmap_enc_mat_t mat;
+    uint64_t bytes;
+    int refs;
+    bool loaded;
+    bool loading;               /* being read from disk, without the lock */
+    int64_t prev;               /* towards the most recently used */
+    int64_t next;               /* towards the least recently used */
+} cached_mat_t;
+
+struct obf_eval_s {
+    const mmap_vtable *vtable;
+    mmap_pp pp;
+    char *dir;
+    container_t *c;
+    uint64_t nlayers;
+    uint64_t nslots;
+    uint64_t *inps;
+    uint64_t *nrows;
+    uint64_t *ncols;
+    uint64_t maxcols;
+    long col;
+    cached_mat_t *cache;        /* nlayers x nslots */
+    uint64_t memcap;
+    uint64_t memused;
+    uint64_t nodecap;           /* max inputs per trie walk, 0 for no limit */
+    int64_t lru_head;
+    int64_t lru_tail;
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;      /* signalled when a load finishes */
+    pthread_mutex_t pool_lock;  /* guards thpool and nthreads; never held by
+                                   evaluations, which take lock */
+    threadpool thpool;          /* runs obf_eval_async jobs, made on demand */
+    uint64_t nthreads;
+    atomic_int pending;         /* obf_eval_async jobs not yet finished */
+    bool verbose;
+};
+
+static void
+lru_unlink(obf_eval_t *h, int64_t k)
+{
+    cached_mat_t *e = &h->cache[k];
+
+    if (e->prev >= 0)
+        h->cache[e->prev].next = e->next;
+    else
+        h->lru_head = e->next;
+    if (e->next >= 0)
+        h->cache[e->next].prev = e->prev;
+    else
+        h->lru_tail = e->prev;
+    e->prev = e->next = -1;
+}
+
+static void
+lru_push(obf_eval_t *h, int64_t k)
+{
+    cached_mat_t *e = &h->cache[k];
+
+    e->prev = -1;
+    e->next = h->lru_head;
+    if (h->lru_head >= 0)
+        h->cache[h->lru_head].prev = k;
+    h->lru_head = k;
+    if (h->lru_tail < 0)
+        h->lru_tail = k;
+}
+
+/* Evicts unpinned matrices until the cache fits in memcap.  Caller holds the
+ * lock. */
+static void
+cache_evict(obf_eval_t *h)
+{
+    int64_t k = h->lru_tail;
+
+    while (h->memcap && h->memused > h->memcap && k >= 0) {
+        cached_mat_t *e = &h->cache[k];
+        int64_t prev = e->prev;
+
+        if (e->refs == 0) {
+            lru_unlink(h, k);
+            mmap_enc_mat_clear(h->vtable, e->mat);
+            e->loaded = false;
+            h->memused -= e->bytes;
+        }
+        k = prev;
+    }
+}
+
+/* Reads matrix (layer, slot) from disk.  Only the first row of the first
+ * layer is ever used, so only that row is loaded.  Called without the handle
+ * lock; a container that could not be mapped is read through its one stream,
+ * so those reads take the container lock instead. */
+static int
+cache_load(obf_eval_t *h, uint64_t layer, uint64_t slot, cached_mat_t *e)
+{
+    FILE *fp;
+    uint64_t nrows = layer == 0 ? 1 : h->nrows[layer];
+    bool shared = h->c && h->c->map == NULL;
+    long start;
+    int ret = OBFUSCATOR_OK;
+
+    if (shared)
+        pthread_mutex_lock(&h->c->lock);
+    if ((fp = open_layer_matrix(h->dir, h->c, layer, slot)) == NULL) {
+        fprintf(stderr, "layer %lu: unable to open matrix %lu\n", layer, slot);
+        ret = OBFUSCATOR_ERR;
+        goto cleanup;
+    }
+    start = ftell(fp);
+    mmap_enc_mat_init(h->vtable, h->pp, e->mat, nrows, h->ncols[layer]);
+    for (uint64_t i = 0; i < nrows; ++i) {
+        for (uint64_t j = 0; j < h->ncols[layer]; ++j) {
+            h->vtable->enc->fread(e->mat->m[i][j], fp);
+        }
+    }
+    e->bytes = ftell(fp) - start;
+    close_layer_matrix(h->c, fp);
+cleanup:
+    if (shared)
+        pthread_mutex_unlock(&h->c->lock);
+    return ret;
+}
+
+/* Returns matrix (layer, slot), loading it if needed, and pins it until the
+ * matching cache_release().  The lock is dropped while the matrix is read, so
+ * loads of different matrices overlap; callers wanting a matrix that is being
+ * loaded wait for that load rather than starting another. */
+static mmap_enc_mat_struct *
+cache_acquire(obf_eval_t *h, uint64_t layer, uint64_t slot)
+{
+    int64_t k = layer * h->nslots + slot;
+    cached_mat_t *e;
+    int ret;
+
+    if (slot >= h->nslots) {
+        fprintf(stderr, "layer %lu: invalid input value %lu\n", layer, slot);
+        return NULL;
+    }
+    e = &h->cache[k];
+    pthread_mutex_lock(&h->lock);
+    while (e->loading)
+        pthread_cond_wait(&h->loaded, &h->lock);
+    if (e->loaded) {
+        lru_unlink(h, k);
+    } else {
+        // the entry is in no list while loading, so nothing else touches it
+        e->loading = true;
+        pthread_mutex_unlock(&h->lock);
+        ret = cache_load(h, layer, slot, e);
+        pthread_mutex_lock(&h->lock);
+        e->loading = false;
+        pthread_cond_broadcast(&h->loaded);
+        if (ret == OBFUSCATOR_ERR) {
+            pthread_mutex_unlock(&h->lock);
+            return NULL;
+        }
+        e->loaded = true;
+        h->memused += e->bytes;
+    }
+    lru_push(h, k);
+    e->refs++;
+    cache_evict(h);
+    pthread_mutex_unlock(&h->lock);
+    return e->mat;
+}
+
+static void
+cache_release(obf_eval_t *h, uint64_t layer, uint64_t slot)
+{
+    pthread_mutex_lock(&h->lock);
+    h->cache[layer * h->nslots + slot].refs--;
+    cache_evict(h);
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* Counts the slot files of layer 0 in dir, or returns 0 if there are none */
+static uint64_t
+count_slots(const char *dir)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t n = 0;
+
+    for (;;) {
+        int len;
+
+        len = snprintf(path, sizeof path, "%s/0.%lu", dir, n);
+        if (len < 0 || (size_t) len >= sizeof path
+            || stat(path, &st) != 0)
+            return n;
+        n++;
+    }
+}
+
+static obf_eval_t *
+eval_open(enum mmap_e type, const char *dir, uint64_t bplen, uint64_t memcap,
+          bool preload, bool verbose)
+{
+    obf_eval_t *h;
+
+    if ((h = calloc(1, sizeof(obf_eval_t))) == NULL)
+        return NULL;
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->loaded, NULL);
+    pthread_mutex_init(&h->pool_lock, NULL);
+    h->lru_head = h->lru_tail = -1;
+    atomic_init(&h->pending, 0);
+    h->memcap = memcap;
+    h->nodecap = EVAL_DEFAULT_NODECAP;
+    h->verbose = verbose;
+    h->dir = strdup(dir);
+    if ((h->vtable = get_vtable(type)) == NULL)
+        goto error;
+    if ((h->pp = load_params(h->vtable, dir, &h->c)) == NULL)
+        goto error;
+
+    if (h->c) {
+        h->nslots = h->c->nslots;
+        if (bplen == 0)
+            bplen = h->c->nlayers;
+    } else {
+        h->nslots = count_slots(dir);
+    }
+    if (bplen == 0 || h->nslots == 0) {
+        fprintf(stderr, "unable to determine size of obfuscation\n");
+        goto error;
+    }
+    h->nlayers = bplen;
+    h->inps = calloc(bplen, sizeof(uint64_t));
+    h->nrows = calloc(bplen, sizeof(uint64_t));
+    h->ncols = calloc(bplen, sizeof(uint64_t));
+    h->cache = calloc(bplen * h->nslots, sizeof(cached_mat_t));
+    for (uint64_t k = 0; k < bplen * h->nslots; ++k)
+        h->cache[k].prev = h->cache[k].next = -1;
+
+    for (uint64_t layer = 0; layer < bplen; ++layer) {
+        if (read_layer_info(dir, h->c, layer, &h->inps[layer],
+                            &h->nrows[layer], &h->ncols[layer])
+            == OBFUSCATOR_ERR)
+            goto error;
+        if (layer > 0 && h->nrows[layer] != h->ncols[layer - 1]) {
+            fprintf(stderr, "layer %lu: dimension mismatch (%lu != %lu)\n",
+                    layer, h->nrows[layer], h->ncols[layer - 1]);
+            goto error;
+        }
+        if (h->ncols[layer] > h->maxcols)
+            h->maxcols = h->ncols[layer];
+    }
+    h->col = zero_test_col(h->nrows[0], h->ncols[bplen - 1]);
+    if ((uint64_t) h->col >= h->ncols[bplen - 1]) {
+        fprintf(stderr, "layer %lu: too few columns\n", bplen - 1);
+        goto error;
+    }
+
+    if (preload) {
+        double start = current_time();
+
+        for (uint64_t layer = 0; layer < bplen; ++layer) {
+            for (uint64_t slot = 0; slot < h->nslots; ++slot) {
+                if (cache_acquire(h, layer, slot) == NULL)
+                    goto error;
+                cache_release(h, layer, slot);
+            }
+            if (h->memcap && h->memused >= h->memcap)
+                break;
+        }
+        if (verbose)
+            (void) fprintf(stderr, "  Loading obfuscation (%lu bytes): %f\n",
+                           h->memused, current_time() - start);
+    }
+
+    return h;
+
+error:
+    obf_eval_close(h);
+    return NULL;
+}
+
+/*
+ * Opens the obfuscation at `dir` (a directory or single-file container) for
+ * repeated evaluation.  bplen may be 0 for containers.  At most memcap bytes
+ * of encodings (as measured by their serialized size) are kept resident, or
+ * all of them if memcap is 0.
+ */
+obf_eval_t *
+obf_eval_open(enum mmap_e type, const char *dir, uint64_t bplen,
+              uint64_t memcap, bool verbose)
+{
+    return eval_open(type, dir, bplen, memcap, true, verbose);
+}
+
+/*
+ * Bounds the inputs a batch evaluation on h walks through at once to nodecap
+ * (EVAL_DEFAULT_NODECAP unless set), or lifts the bound if nodecap is 0.  A
+ * walk keeps the partial products of two consecutive layers, so at most
+ * 2 * nodecap row vectors of the widest layer are resident, besides one
+ * scratch vector per thread.
+ */
+void
+obf_eval_set_nodecap(obf_eval_t *h, uint64_t nodecap)
+{
+    h->nodecap = nodecap;
+}
+
+static void
+eval_free(obf_eval_t *h)
+{
+    if (h->thpool) {
+        thpool_wait(h->thpool);
+        thpool_destroy(h->thpool);
+    }
+    if (h->cache) {
+        for (uint64_t k = 0; k < h->nlayers * h->nslots; ++k) {
+            if (h->cache[k].loaded)
+                mmap_enc_mat_clear(h->vtable, h->cache[k].mat);
+        }
+    }
+    free(h->cache);
+    free(h->inps);
+    free(h->nrows);
+    free(h->ncols);
+    if (h->pp) {
+        h->vtable->pp->clear(h->pp);
+        free(h->pp);
+    }
+    container_close(h->c);
+    pthread_mutex_destroy(&h->lock);
+    pthread_cond_destroy(&h->loaded);
+    pthread_mutex_destroy(&h->pool_lock);
+    free(h->dir);
+    free(h);
+}
+
+static void *
+eval_reap(void *vargs)
+{
+    eval_free((obf_eval_t *) vargs);
+    return NULL;
+}
+
+/*
+ * Closes h.  Never waits for evaluations queued by obf_eval_async: if any are
+ * unfinished, h is handed to a detached thread that frees it once they are
+ * done, so their callbacks still run.
+ */
+void
+obf_eval_close(obf_eval_t *h)
+{
+    pthread_t thread;
+
+    if (h == NULL)
+        return;
+    if (atomic_load(&h->pending) > 0
+        && pthread_create(&thread, NULL, eval_reap, h) == 0) {
+        pthread_detach(thread);
+        return;
+    }
+    eval_free(h);
+}
+
+/*
+ * Batches are evaluated over a trie of the inputs in layer order: two inputs
+ * that select the same matrices in layers 0..l share the same partial product
+ * up to layer l, which is then computed only once.  Inputs are sorted so that
+ * each node of the trie covers a contiguous run of them, and the trie is
+ * walked one layer at a time, keeping one row vector per node of the current
+ * and previous layer.
+ */
+
+typedef struct {
+    uint64_t *slots;            /* matrix selected in each layer */
+    uint64_t nlayers;
+    uint64_t k;                 /* index of the input in the batch */
+} trie_key_t;
+
+static int
+trie_key_cmp(const void *a, const void *b)
+{
+    const trie_key_t *x = a, *y = b;
+
+    for (uint64_t layer = 0; layer < x->nlayers; ++layer) {
+        if (x->slots[layer] != y->slots[layer])
+            return x->slots[layer] < y->slots[layer] ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Applies the matrices of `layer` to the trie nodes of the previous layer.
+ * Node i of this layer extends node parents[i] by matrix slots[i], so v[i] =
+ * u[parents[i]] * M_{layer, slots[i]}.  Nodes are computed in parallel.
+ */
+static int
+eval_layer(obf_eval_t *h, uint64_t layer, uint64_t nnodes,
+           const uint64_t *slots, const uint64_t *parents, mmap_enc ***u,
+           mmap_enc ***v, mmap_enc ***tmps)
+{
+    const mmap_vtable *vtable = h->vtable;
+    uint64_t ncols = h->ncols[layer];
+    long col = layer == h->nlayers - 1 ? h->col : -1;
+    mmap_enc_mat_struct **mats;
+    int ret = OBFUSCATOR_OK;
+
+    // pin each matrix of this layer needed by some node, once
+    mats = calloc(h->nslots, sizeof(mmap_enc_mat_struct *));
+    for (uint64_t i = 0; i < nnodes; ++i) {
+        if (slots[i] >= h->nslots) {
+            fprintf(stderr, "layer %lu: invalid input value %lu\n", layer,
+                    slots[i]);
+            ret = OBFUSCATOR_ERR;
+            goto done;
+        }
+        if (mats[slots[i]] == NULL
+            && (mats[slots[i]] = cache_acquire(h, layer, slots[i])) == NULL) {
+            ret = OBFUSCATOR_ERR;
+            goto done;
+        }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (uint64_t i = 0; i < nnodes; ++i) {
+        mmap_enc_mat_struct *m = mats[slots[i]];
+
+        if (layer == 0) {
+            for (uint64_t j = 0; j < ncols; ++j)
+                vtable->enc->set(v[i][j], m->m[0][j]);
+        } else {
+            enc_vec_mul_mat(vtable, h->pp, v[i], u[parents[i]], m,
+                            m->nrows, m->ncols, tmps[omp_get_thread_num()],
+                            col);
+        }
+    }
+
+done:
+    for (uint64_t slot = 0; slot < h->nslots; ++slot) {
+        if (mats[slot])
+            cache_release(h, layer, slot);
+    }
+    free(mats);
+    return ret;
+}
+
+static void
+eval_nodes_clear(obf_eval_t *h, mmap_enc ***v, uint64_t nnodes)
+{
+    for (uint64_t i = 0; i < nnodes; ++i) {
+        if (v[i])
+            enc_vec_clear(h->vtable, v[i], h->maxcols);
+    }
+    free(v);
+}
+
+/*
+ * Evaluates n inputs, sorted in trie order, where lcp[p] is the number of
+ * leading layers in which inputs p - 1 and p select the same matrices.  The
+ * node vectors of consecutive layers ping-pong between two sets of buffers of
+ * the largest layer width, allocated the first time they are needed, so
+ * encodings are initialized once per walk rather than once per layer.
+ */
+static int
+eval_trie(obf_eval_t *h, const trie_key_t *keys, const uint64_t *lcp,
+          uint64_t n, int *results)
+{
+    mmap_enc ***u, ***v, ***swap, ***tmps;
+    uint64_t *owner, *slots, *parents;
+    uint64_t layer, nu = 0, nv = 0;
+    int *iszero = NULL, nthreads = omp_get_max_threads();
+    int ret = OBFUSCATOR_ERR;
+    double start, end;
+
+    owner = calloc(n, sizeof(uint64_t));
+    slots = calloc(n, sizeof(uint64_t));
+    parents = calloc(n, sizeof(uint64_t));
+    u = calloc(n, sizeof(mmap_enc **));
+    v = calloc(n, sizeof(mmap_enc **));
+    tmps = calloc(nthreads, sizeof(mmap_enc **));
+    for (int t = 0; t < nthreads; ++t)
+        tmps[t] = enc_vec_init(h->vtable, h->pp, h->maxcols);
+
+    for (layer = 0; layer < h->nlayers; ++layer) {
+        start = current_time();
+        // a new node starts wherever the input differs from its predecessor
+        // in some layer up to this one
+        nv = 0;
+        for (uint64_t p = 0; p < n; ++p) {
+            if (p == 0 || lcp[p] <= layer) {
+                slots[nv] = keys[p].slots[layer];
+                parents[nv] = owner[p];
+                nv++;
+            }
+            owner[p] = nv - 1;
+        }
+        for (uint64_t i = 0; i < nv; ++i) {
+            if (v[i] == NULL)
+                v[i] = enc_vec_init(h->vtable, h->pp, h->maxcols);
+        }
+        if (eval_layer(h, layer, nv, slots, parents, u, v, tmps)
+            == OBFUSCATOR_ERR)
+            goto done;
+        swap = u;
+        u = v;
+        v = swap;
+        nu = nv;
+        end = current_time();
+        if (h->verbose)
+            (void) fprintf(stderr, "  Layer %lu (%lu products): %f\n", layer,
+                           nv, end - start);
+    }
+
+    start = current_time();
+    iszero = calloc(nu, sizeof(int));
+#pragma omp parallel for
+    for (uint64_t i = 0; i < nu; ++i)
+        iszero[i] = h->vtable->enc->is_zero(u[i][h->col], h->pp);
+    for (uint64_t p = 0; p < n; ++p)
+        results[keys[p].k] = iszero[owner[p]];
+    end = current_time();
+    if (h->verbose)
+        (void) fprintf(stderr, "  Zero test: %f\n", end - start);
+    ret = OBFUSCATOR_OK;
+
+done:
+    eval_nodes_clear(h, u, n);
+    eval_nodes_clear(h, v, n);
+    eval_nodes_clear(h, tmps, nthreads);
+    free(iszero);
+    free(owner);
+    free(slots);
+    free(parents);
+    return ret;
+}
+
+/*
+ * Evaluates a single input with a tree of concurrent matrix products over the
+ * cached matrices, all of which stay pinned for the duration.
+ */
+static int
+eval_tree_handle(obf_eval_t *h, uint64_t *input, uint64_t ncores,
+                 int *result)
+{
+    mmap_enc_mat_struct **leaves;
+    mmap_enc_mat_t last;
+    uint64_t n = h->nlayers, layer;
+    int ret = OBFUSCATOR_ERR;
+    double start, end;
+
+    leaves = calloc(n, sizeof(mmap_enc_mat_struct *));
+    for (layer = 0; layer < n; ++layer) {
+        if ((leaves[layer] = cache_acquire(h, layer, input[h->inps[layer]]))
+            == NULL)
+            goto done;
+    }
+
+    // only the zero-tested column of the last layer is needed
+    mmap_enc_mat_init(h->vtable, h->pp, last, h->nrows[n - 1], 1);
+    for (uint64_t i = 0; i < h->nrows[n - 1]; ++i)
+        h->vtable->enc->set(last->m[i][0], leaves[n - 1]->m[i][h->col]);
+    cache_release(h, n - 1, input[h->inps[n - 1]]);
+    leaves[n - 1] = last;
+
+    start = current_time();
+    *result = eval_tree(h->vtable, h->pp, leaves, n, ncores);
+    end = current_time();
+    if (h->verbose)
+        (void) fprintf(stderr, "  Multiplying matrices (%lu cores): %f\n",
+                       ncores, end - start);
+    mmap_enc_mat_clear(h->vtable, last);
+    if (*result != -1)
+        ret = OBFUSCATOR_OK;
+
+done:
+    // layers [0, layer) are pinned, apart from the last one once copied
+    for (uint64_t k = 0; k < layer && k < n - 1; ++k)
+        cache_release(h, k, input[h->inps[k]]);
+    free(leaves);
+    return ret;
+}
+
+/*
+ * Evaluates the obfuscation on ninputs inputs at once.  Input k is given by
+ * inputs[k * len .. (k + 1) * len) and its zero-test result is stored in
+ * results[k].  Partial products shared by several inputs are computed once.
+ * Inputs are taken in runs of at most the handle's node cap, as each run
+ * holds up to two partial products per input (see obf_eval_set_nodecap).
+ */
+int
+obf_eval_batch(obf_eval_t *h, uint64_t ninputs, uint64_t len,
+               uint64_t *inputs, uint64_t ncores, int *results)
+{
+    trie_key_t *keys;
+    uint64_t *slots, *lcp, layer;
+    int ret = OBFUSCATOR_OK;
+
+    if (ninputs == 0)
+        return OBFUSCATOR_OK;
+    for (layer = 0; layer < h->nlayers; ++layer) {
+        if (h->inps[layer] >= len) {
+            fprintf(stderr, "invalid input: %lu >= %lu\n", h->inps[layer],
+                    len);
+            return OBFUSCATOR_ERR;
+        }
+    }
+    if (ncores > 0)
+        omp_set_num_threads(ncores);
+    if (ninputs == 1 && ncores > 1 && h->nlayers > 1)
+        return eval_tree_handle(h, inputs, ncores, results);
+
+    keys = calloc(ninputs, sizeof(trie_key_t));
+    slots = calloc(ninputs * h->nlayers, sizeof(uint64_t));
+    lcp = calloc(ninputs, sizeof(uint64_t));
+    for (uint64_t k = 0; k < ninputs; ++k) {
+        keys[k].slots = &slots[k * h->nlayers];
+        keys[k].nlayers = h->nlayers;
+        keys[k].k = k;
+        for (layer = 0; layer < h->nlayers; ++layer)
+            keys[k].slots[layer] = inputs[k * len + h->inps[layer]];
+    }
+    qsort(keys, ninputs, sizeof(trie_key_t), trie_key_cmp);
+    for (uint64_t p = 1; p < ninputs; ++p) {
+        while (lcp[p] < h->nlayers
+               && keys[p].slots[lcp[p]] == keys[p - 1].slots[lcp[p]])
+            lcp[p]++;
+    }
+
+    for (uint64_t lo = 0, n; lo < ninputs; lo += n) {
+        n = ninputs - lo;
+        if (h->nodecap && n > h->nodecap)
+            n = h->nodecap;
+        if ((ret = eval_trie(h, keys + lo, lcp + lo, n, results))
+            == OBFUSCATOR_ERR)
+            break;
+    }
+
+    free(keys);
+    free(slots);
+    free(lcp);
+    return ret;
+}
+
+int
+obf_eval(obf_eval_t *h, uint64_t len, uint64_t *input, uint64_t ncores)
+{
+    int iszero;
+
+    if (obf_eval_batch(h, 1, len, input, ncores, &iszero) == OBFUSCATOR_ERR)
+        return -1;
+    return iszero;
+}
+
+/*
+ * Asynchronous evaluation.  Evaluations queued by obf_eval_async run on a
+ * thread pool owned by the handle and share its cache, so several can be in
+ * flight at once.
+ */
+
+struct eval_job_s {
+    obf_eval_t *h;
+    uint64_t len;
+    uint64_t *input;
+    uint64_t ncores;
+    obf_eval_callback_t callback;
+    void *arg;
+};
+
+static void *
+thpool_eval(void *vargs)
+{
+    struct eval_job_s *job = (struct eval_job_s *) vargs;
+    int iszero;
+
+    iszero = obf_eval(job->h, job->len, job->input, job->ncores);
+    job->callback(iszero, job->arg);
+    // counted down only once the callback has run, so close waits for it
+    atomic_fetch_sub(&job->h->pending, 1);
+    free(job->input);
+    free(job);
+    return NULL;
+}
+
+/*
+ * Runs up to nthreads evaluations queued by obf_eval_async at once (one by
+ * default), after waiting for those already queued.  May be called
+ * concurrently with obf_eval_async and obf_eval_wait, which block meanwhile,
+ * but not from an obf_eval_async callback.
+ */
+int
+obf_eval_set_nthreads(obf_eval_t *h, uint64_t nthreads)
+{
+    if (nthreads == 0)
+        return OBFUSCATOR_ERR;
+    pthread_mutex_lock(&h->pool_lock);
+    if (h->thpool) {
+        thpool_wait(h->thpool);
+        thpool_destroy(h->thpool);
+        h->thpool = NULL;
+    }
+    h->nthreads = nthreads;
+    pthread_mutex_unlock(&h->pool_lock);
+    return OBFUSCATOR_OK;
+}
+
+/*
+ * Queues an evaluation of h on `input` and returns without waiting for it.
+ * Once it finishes, callback(iszero, arg) is called from a pool thread with
+ * what obf_eval would have returned.  The input is copied.
+ */
+int
+obf_eval_async(obf_eval_t *h, uint64_t len, const uint64_t *input,
+               uint64_t ncores, obf_eval_callback_t callback, void *arg)
+{
+    struct eval_job_s *job;
+    int ret = OBFUSCATOR_ERR;
+
+    job = calloc(1, sizeof(struct eval_job_s));
+    job->h = h;
+    job->len = len;
+    job->input = calloc(len ? len : 1, sizeof(uint64_t));
+    memcpy(job->input, input, len * sizeof(uint64_t));
+    job->ncores = ncores;
+    job->callback = callback;
+    job->arg = arg;
+
+    pthread_mutex_lock(&h->pool_lock);
+    if (h->thpool == NULL)
+        h->thpool = thpool_init(h->nthreads ? h->nthreads : 1);
+    atomic_fetch_add(&h->pending, 1);
+    if (h->thpool && thpool_add_work(h->thpool, thpool_eval, job, -1) == 0)
+        ret = OBFUSCATOR_OK;
+    else
+        atomic_fetch_sub(&h->pending, 1);
+    pthread_mutex_unlock(&h->pool_lock);
+    if (ret == OBFUSCATOR_ERR) {
+        free(job->input);
+        free(job);
+    }
+    return ret;
+}
+
+/*
+ * Waits for every evaluation queued by obf_eval_async to finish; calls to
+ * obf_eval_async from other threads block meanwhile.  Not to be called from an
+ * obf_eval_async callback.
+ */
+void
+obf_eval_wait(obf_eval_t *h)
+{
+    pthread_mutex_lock(&h->pool_lock);
+    if (h->thpool)
+        thpool_wait(h->thpool);
+    pthread_mutex_unlock(&h->pool_lock);
+}
+
+/*
+ * Incremental evaluation sessions.
+ *
+ * A session holds one input and a segment tree over the layers of the
+ * obfuscation.  Leaf t is the matrix selected by the input in layer t (cut
+ * down to the zero-tested column in the last layer) and each internal node
+ * holds the product of the leaves below it, so the root is the 1 x 1 entry
+ * that gets zero-tested.  Changing an input value replaces the leaves of the
+ * layers that read it, after which only their ancestors are recomputed: a
+ * single changed layer costs O(log L) matrix products instead of L.
+ */
+
+struct obf_session_s {
+    obf_eval_t *h;
+    uint64_t len;
+    uint64_t *input;
+    uint64_t ncores;
+    mmap_enc_mat_struct **tree;  /* heap-ordered, node 1 is the root */
+    bool *dirty;
+    uint64_t *leaf;              /* tree node of each layer */
+    mmap_enc_mat_t last;         /* zero-tested column of the last layer */
+    int iszero;
+};
+
+static void
+session_build(obf_session_t *s, uint64_t node, uint64_t lo, uint64_t hi)
+{
+    obf_eval_t *h = s->h;
+    uint64_t mid = (lo + hi) / 2;
+
+    s->dirty[node] = true;
+    if (lo == hi) {
+        s->leaf[lo] = node;
+        return;
+    }
+    session_build(s, 2 * node, lo, mid);
+    session_build(s, 2 * node + 1, mid + 1, hi);
+    s->tree[node] = malloc(sizeof(mmap_enc_mat_struct));
+    mmap_enc_mat_init(h->vtable, h->pp, s->tree[node],
+                      lo == 0 ? 1 : h->nrows[lo],
+                      hi == h->nlayers - 1 ? 1 : h->ncols[hi]);
+}
+
+/* Makes m, the matrix of `layer` for `slot` pinned by the caller, the leaf of
+ * that layer. */
+static void
+session_put_leaf(obf_session_t *s, uint64_t layer, uint64_t slot,
+                 mmap_enc_mat_struct *m)
+{
+    obf_eval_t *h = s->h;
+    uint64_t node = s->leaf[layer];
+
+    if (layer == h->nlayers - 1 && layer > 0) {
+        for (uint64_t i = 0; i < h->nrows[layer]; ++i)
+            h->vtable->enc->set(s->last->m[i][0], m->m[i][h->col]);
+        cache_release(h, layer, slot);
+        m = s->last;
+    }
+    s->tree[node] = m;
+    for (; node > 0; node /= 2)
+        s->dirty[node] = true;
+}
+
+/* Pins the matrix selected in `layer` by the current input as its leaf. */
+static int
+session_set_leaf(obf_session_t *s, uint64_t layer)
+{
+    uint64_t slot = s->input[s->h->inps[layer]];
+    mmap_enc_mat_struct *m;
+
+    if ((m = cache_acquire(s->h, layer, slot)) == NULL)
+        return OBFUSCATOR_ERR;
+    session_put_leaf(s, layer, slot, m);
+    return OBFUSCATOR_OK;
+}
+
+static void
+session_unset_leaf(obf_session_t *s, uint64_t layer)
+{
+    obf_eval_t *h = s->h;
+
+    if (s->tree[s->leaf[layer]] == NULL)
+        return;
+    if (s->tree[s->leaf[layer]] != s->last)
+        cache_release(h, layer, s->input[h->inps[layer]]);
+    s->tree[s->leaf[layer]] = NULL;
+}
+
+static void
+session_update(obf_session_t *s, uint64_t node, uint64_t lo, uint64_t hi)
+{
+    uint64_t mid = (lo + hi) / 2;
+
+    if (!s->dirty[node])
+        return;
+    s->dirty[node] = false;
+    if (lo == hi)
+        return;
+#pragma omp task
+    session_update(s, 2 * node, lo, mid);
+    session_update(s, 2 * node + 1, mid + 1, hi);
+#pragma omp taskwait
+    enc_mat_mul_tasks(s->h->vtable, s->h->pp, s->tree[node],
+                      s->tree[2 * node], s->tree[2 * node + 1]);
+}
+
+static void
+session_eval(obf_session_t *s)
+{
+    obf_eval_t *h = s->h;
+    double start, end;
+
+    start = current_time();
+    if (s->ncores > 0)
+        omp_set_num_threads(s->ncores);
+#pragma omp parallel
+#pragma omp single
+    session_update(s, 1, 0, h->nlayers - 1);
+    // with a single layer the root is that layer's first row
+    s->iszero = h->vtable->enc->is_zero(
+        s->tree[1]->m[0][h->nlayers > 1 ? 0 : h->col], h->pp);
+    end = current_time();
+    if (h->verbose)
+        (void) fprintf(stderr, "  Session update: %f\n", end - start);
+}
+
+/*
+ * Starts a session on handle h at the given input, which is evaluated right
+ * away.  The handle must stay open until the session is closed.
+ */
+obf_session_t *
+obf_session_open(obf_eval_t *h, uint64_t len, const uint64_t *input,
+                 uint64_t ncores)
+{
+    obf_session_t *s;
+    uint64_t n = h->nlayers;
+
+    for (uint64_t layer = 0; layer < n; ++layer) {
+        if (h->inps[layer] >= len) {
+            fprintf(stderr, "invalid input: %lu >= %lu\n", h->inps[layer],
+                    len);
+            return NULL;
+        }
+    }
+
+    s = calloc(1, sizeof(obf_session_t));
+    s->h = h;
+    s->len = len;
+    s->ncores = ncores;
+    s->input = calloc(len, sizeof(uint64_t));
+    memcpy(s->input, input, len * sizeof(uint64_t));
+    s->tree = calloc(4 * n, sizeof(mmap_enc_mat_struct *));
+    s->dirty = calloc(4 * n, sizeof(bool));
+    s->leaf = calloc(n, sizeof(uint64_t));
+    mmap_enc_mat_init(h->vtable, h->pp, s->last, h->nrows[n - 1], 1);
+    session_build(s, 1, 0, n - 1);
+    for (uint64_t layer = 0; layer < n; ++layer) {
+        if (session_set_leaf(s, layer) == OBFUSCATOR_ERR) {
+            obf_session_close(s);
+            return NULL;
+        }
+    }
+    session_eval(s);
+    return s;
+}
+
+/*
+ * Sets input[positions[i]] = values[i] for i < nchanges and returns the
+ * zero-test result of the new input, or -1 on error.  On error, including a
+ * matrix that cannot be loaded, the session is left at its previous input.
+ */
+int
+obf_session_set(obf_session_t *s, uint64_t nchanges,
+                const uint64_t *positions, const uint64_t *values)
+{
+    obf_eval_t *h = s->h;
+    mmap_enc_mat_struct **mats;
+    uint64_t *input, layer;
+    int ret = -1;
+
+    for (uint64_t i = 0; i < nchanges; ++i) {
+        if (positions[i] >= s->len) {
+            fprintf(stderr, "invalid input position: %lu >= %lu\n",
+                    positions[i], s->len);
+            return -1;
+        }
+        if (values[i] >= h->nslots) {
+            fprintf(stderr, "invalid input value %lu\n", values[i]);
+            return -1;
+        }
+    }
+
+    input = calloc(s->len, sizeof(uint64_t));
+    mats = calloc(h->nlayers, sizeof(mmap_enc_mat_struct *));
+    memcpy(input, s->input, s->len * sizeof(uint64_t));
+    for (uint64_t i = 0; i < nchanges; ++i)
+        input[positions[i]] = values[i];
+
+    // pin every new leaf before letting go of any old one
+    for (layer = 0; layer < h->nlayers; ++layer) {
+        uint64_t pos = h->inps[layer];
+
+        if (input[pos] != s->input[pos]
+            && (mats[layer] = cache_acquire(h, layer, input[pos])) == NULL)
+            goto cleanup;
+    }
+    for (layer = 0; layer < h->nlayers; ++layer) {
+        if (mats[layer] == NULL)
+            continue;
+        session_unset_leaf(s, layer);
+        session_put_leaf(s, layer, input[h->inps[layer]], mats[layer]);
+        mats[layer] = NULL;
+    }
+    memcpy(s->input, input, s->len * sizeof(uint64_t));
+    session_eval(s);
+    ret = s->iszero;
+
+cleanup:
+    for (layer = 0; layer < h->nlayers; ++layer) {
+        if (mats[layer])
+            cache_release(h, layer, input[h->inps[layer]]);
+    }
+    free(mats);
+    free(input);
+    return ret;
+}
+
+/* Returns the zero-test result of the session's current input. */
+int
+obf_session_result(const obf_session_t *s)
+{
+    return s->iszero;
+}
+
+void
+obf_session_close(obf_session_t *s)
+{
+    obf_eval_t *h;
+
+    if (s == NULL)
+        return;
+    h = s->h;
+    for (uint64_t layer = 0; layer < h->nlayers; ++layer)
+        session_unset_leaf(s, layer);
+    for (uint64_t node = 1; node < 4 * h->nlayers; ++node) {
+        if (s->tree[node]) {
+            mmap_enc_mat_clear(h->vtable, s->tree[node]);
+            free(s->tree[node]);
+        }
+    }
+    mmap_enc_mat_clear(h->vtable, s->last);
+    free(s->tree);
+    free(s->dirty);
+    free(s->leaf);
+    free(s->input);
+    free(s);
+}
+
+/*
+ * Evaluates the obfuscation on ninputs inputs at once, reading each layer
+ * from disk once, only for the input values that some input actually uses.
+ * The layers stay cached for the whole call, as the inputs are worked
+ * through nodecap at a time, and are freed before returning.
+ */
+int
+obf_evaluate_batch(enum mmap_e type, char *dir, uint64_t ninputs,
+                   uint64_t len, uint64_t *inputs, uint64_t bplen,
+                   uint64_t ncores, bool verbose, int *results)
+{
+    obf_eval_t *h;
+    int ret;
+
+    if (bplen == 0)
+        return OBFUSCATOR_ERR;
+    // no cap, so later chunks of inputs reuse the layers already read
+    if ((h = eval_open(type, dir, bplen, 0, false, verbose)) == NULL)
+        return OBFUSCATOR_ERR;
+    ret = obf_eval_batch(h, ninputs, len, inputs, ncores, results);
+    obf_eval_close(h);
+    return ret;
+}
+
+int
+obf_container_info(const char *fname, uint64_t *nslots, uint64_t *nlayers)
+{
+    container_t *c;
+
+    if ((c = container_open(fname)) == NULL)
+        return OBFUSCATOR_ERR;
+    *nslots = c->nslots;
+    *nlayers = c->nlayers;
+    container_close(c);
+    return OBFUSCATOR_OK;
+}
@@ -1,11 +1,39 @@
 #include "obfuscator.h"
+#include "container.h"
 #include "thpool.h"
 #include "thpool_fns.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <oz/flint-addons.h>
-#include <mmap/mmap_clt.h>
-#include <mmap/mmap_gghlite.h>
-#include <mmap/mmap_dummy.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Minimum number of matrix entries encoded by a single thread pool job */
+#define ENCODE_TILE_SIZE 64
+/* Rows of a slot matrix randomized by a single OpenMP iteration */
+#define RANDOMIZE_BLOCK_ROWS 16
+/* Slot matrices with at most 1 / RANDOMIZE_SPARSE_RATIO nonzero entries are
+ * multiplied by a dense left randomizer as sparse matrices */
+#define RANDOMIZE_SPARSE_RATIO 4
+
+#define OBF_RAND_ALL UINT64_MAX
+#define OBF_RAND_RANDOMIZER (UINT64_MAX - 1)
+
+/* Ends a complete checkpoint state file */
+#define OBF_STATE_MAGIC 0x6f62667374617465ULL
+
+/* Kilian randomizer between layers b and b + 1, drawn by obf_randomizer_chain */
+struct link_s {
+    long n;                     /* 0 if not drawn */
+    fmpz_mat_t randomizer;
+    fmpz_mat_t inverse;
+    bool randomizer_used;
+    bool inverse_used;
+};
 
 typedef struct obf_state_s {
     threadpool thpool;
@@ -14,24 +42,154 @@ typedef struct obf_state_s {
     mmap_sk mmap;
     const mmap_vtable *vtable;
     aes_randstate_t rand;
-    uint64_t nthreads;
-    aes_randstate_t *rands;
+    char seed[AES_SEED_BYTE_SIZE];
     const char *dir;
+    container_t *container;
     uint64_t nzs;
-    fmpz_mat_t *randomizer;
+    uint64_t ncores;
     fmpz_mat_t *inverse;
+    bool inverse_held;          /* *inverse holds a matrix */
+    bool redraw;                /* a skipped layer's inverse is needed */
+    struct link_s *chain;
+    uint64_t nlinks;
+    int randomized;             /* group of the last randomization job */
+    atomic_int randomizing;     /* randomization jobs running */
+    struct budget_s budget;
+    struct snapshot_s snapshot;
     uint64_t flags;
 } obf_state_t;
 
+/* Randomizes a layer's matrices as a single job */
+struct randomize_layer_s {
+    obf_state_t *s;
+    long idx;
+    uint64_t n;
+    long nrows;
+    long ncols;
+    fmpz_mat_t *mats;
+    encode_layer_randomization_flag_t rflag;
+    bool redraw;                /* the previous layer was skipped */
+};
 
-static FILE *
-open_indexed_file(const char *dir, const char *file, uint64_t index,
-                  const char *mode)
+/* Returns dir/file in a newly allocated string */
+static char *
+state_path(const obf_state_t *s, const char *file)
+{
+    char *fname;
+    size_t len;
+
+    len = strlen(s->dir) + strlen(file) + 2;
+    if ((fname = malloc(len)) != NULL)
+        (void) snprintf(fname, len, "%s/%s", s->dir, file);
+    return fname;
+}
+
+/*
+ * Saves the seed and secret key, including the random state it encodes with,
+ * to dir/state, readable by the owner only, so that an interrupted run can be
+ * resumed with the same keys.  The state is written to dir/state.tmp and
+ * renamed over the old one, so a crash leaves one or the other intact.
+ */
+static int
+obf_write_state(obf_state_t *s)
+{
+    const uint64_t magic = OBF_STATE_MAGIC;
+    char *fname, *tmpname;
+    FILE *fp = NULL;
+    int fd = -1, ret = OBFUSCATOR_ERR;
+
+    fname = state_path(s, "state");
+    tmpname = state_path(s, "state.tmp");
+    if (fname == NULL || tmpname == NULL)
+        goto cleanup;
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1 || fchmod(fd, S_IRUSR | S_IWUSR) == -1
+        || (fp = fdopen(fd, "wb")) == NULL) {
+        fprintf(stderr, "unable to open '%s'\n", tmpname);
+        goto cleanup;
+    }
+    fwrite(s->seed, sizeof(char), AES_SEED_BYTE_SIZE, fp);
+    s->vtable->sk->fwrite(s->mmap, fp);
+    fwrite(&magic, sizeof magic, 1, fp);
+    if (ferror(fp) || fflush(fp) != 0 || fsync(fd) != 0
+        || rename(tmpname, fname) == -1) {
+        fprintf(stderr, "unable to write '%s'\n", fname);
+        goto cleanup;
+    }
+    ret = OBFUSCATOR_OK;
+cleanup:
+    if (fp)
+        fclose(fp);
+    else if (fd != -1)
+        close(fd);
+    free(fname);
+    free(tmpname);
+    return ret;
+}
+
+/*
+ * Saves the state once the layer being written is done, between encodings so
+ * that the secret key's random state is consistent.  Called from
+ * thpool_write_layer.
+ */
+static int
+obf_save_state(void *vs)
 {
-    char fname[50];
+    obf_state_t *s = (obf_state_t *) vs;
+    int ret;
 
-    (void) snprintf(fname, 50, "%lu.%s", index, file);
-    return open_file(dir, fname, mode);
+    snapshot_begin(&s->snapshot);
+    ret = obf_write_state(s);
+    snapshot_end(&s->snapshot);
+    return ret;
+}
+
+/* Restores the seed and secret key saved by obf_write_state */
+static int
+obf_read_state(obf_state_t *s)
+{
+    FILE *fp;
+    uint64_t magic = 0;
+
+    if ((fp = open_file(s->dir, "state", "rb")) == NULL)
+        return OBFUSCATOR_ERR;
+    if (fread(s->seed, sizeof(char), AES_SEED_BYTE_SIZE, fp)
+        != AES_SEED_BYTE_SIZE) {
+        fprintf(stderr, "unable to read seed from checkpoint state\n");
+        fclose(fp);
+        return OBFUSCATOR_ERR;
+    }
+    aes_randinit_seedn(s->rand, s->seed, AES_SEED_BYTE_SIZE, NULL, 0);
+    s->mmap = malloc(s->vtable->sk->size);
+    s->vtable->sk->fread(s->mmap, fp);
+    /* sk->fread cannot fail, so check the key was read in full */
+    if (fread(&magic, sizeof magic, 1, fp) != 1 || magic != OBF_STATE_MAGIC
+        || ferror(fp)) {
+        fprintf(stderr, "unable to read secret key from checkpoint state\n");
+        s->vtable->sk->clear(s->mmap);
+        free(s->mmap);
+        s->mmap = NULL;
+        aes_randclear(s->rand);
+        fclose(fp);
+        return OBFUSCATOR_ERR;
+    }
+    fclose(fp);
+    return OBFUSCATOR_OK;
+}
+
+/* Whether a previous run has written layer idx in full */
+static bool
+obf_layer_done(const obf_state_t *s, long idx)
+{
+    char file[30], *fname;
+    bool done;
+
+    (void) snprintf(file, sizeof file, "%ld.done", idx);
+    if ((fname = state_path(s, file)) == NULL)
+        return false;
+    done = access(fname, F_OK) == 0;
+    free(fname);
+    return done;
 }
 
 obf_state_t *
@@ -43,6 +201,11 @@ obf_init(enum mmap_e type, const char *dir, size_t secparam, size_t kappa,
 
     if (secparam == 0 || kappa == 0 || nzs == 0)
         return NULL;
+    if (flags & (OBFUSCATOR_FLAG_CHECKPOINT | OBFUSCATOR_FLAG_RESUME)
+        && flags & OBFUSCATOR_FLAG_CONTAINER) {
+        fprintf(stderr, "error: checkpointing needs a directory\n");
+        return NULL;
+    }
 
     s = calloc(1, sizeof(obf_state_t));
     if (s == NULL)
@@ -53,24 +216,26 @@ obf_init(enum mmap_e type, const char *dir, size_t secparam, size_t kappa,
     s->dir = dir;
     s->nzs = nzs;
     s->flags = flags;
-    s->randomizer = malloc(sizeof(fmpz_mat_t));
+    s->randomized = -1;
+    atomic_init(&s->randomizing, 0);
+    budget_init(&s->budget);
+    snapshot_init(&s->snapshot);
+    s->ncores = ncores;
     s->inverse = malloc(sizeof(fmpz_mat_t));
 
-    switch (s->type) {
-    case MMAP_DUMMY:
-        s->vtable = &dummy_vtable;
-        break;
-    case MMAP_CLT:
-        s->vtable = &clt_vtable;
-        break;
-    case MMAP_GGHLITE:
-        s->vtable = &gghlite_vtable;
-        break;
-    default:
+    if ((s->vtable = get_vtable(s->type)) == NULL) {
+        free(s->inverse);
+        free(s);
         return NULL;
     }
 
-    if (seed) {
+    if (s->flags & OBFUSCATOR_FLAG_RESUME) {
+        if (obf_read_state(s) == OBFUSCATOR_ERR) {
+            free(s->inverse);
+            free(s);
+            return NULL;
+        }
+    } else if (seed) {
         FILE *f;
         char dest[AES_SEED_BYTE_SIZE];
         size_t n;
@@ -95,24 +260,23 @@ obf_init(enum mmap_e type, const char *dir, size_t secparam, size_t kappa,
             fprintf(stderr, "\n");
         }
         aes_randinit_seedn(s->rand, dest, AES_SEED_BYTE_SIZE, NULL, 0);
+        memcpy(s->seed, dest, AES_SEED_BYTE_SIZE);
     } else {
+        unsigned char *buf;
+        size_t nbytes;
+
         (void) aes_randinit(s->rand);
+        buf = random_aes(s->rand, 8 * AES_SEED_BYTE_SIZE, &nbytes);
+        memcpy(s->seed, buf, AES_SEED_BYTE_SIZE);
+        free(buf);
     }
     if (nthreads == 0)
         nthreads = ncores;
+    // only the dummy mmap encodes without drawing from the key's shared state
+    if (seed && s->type != MMAP_DUMMY && nthreads > 1)
+        fprintf(stderr, "warning: encodings depend on thread scheduling, so "
+                "a seeded run is only reproducible with one thread\n");
     s->thpool = thpool_init(nthreads);
-    s->nthreads = nthreads;
-
-    /* Generate dedicated randomness for threads */
-    s->rands = calloc(nthreads, sizeof(aes_randstate_t));
-    for (uint64_t i = 0; i < nthreads; ++i) {
-        unsigned char *buf;
-        size_t nbits = 128, nbytes;
-
-        buf = random_aes(s->rand, nbits, &nbytes);
-        aes_randinit_seedn(s->rands[i], (char *) buf, nbytes, NULL, 0);
-        free(buf);
-    }
 
     if (s->flags & OBFUSCATOR_FLAG_VERBOSE) {
         fprintf(stderr, "  # Threads: %lu\n", nthreads);
@@ -121,12 +285,28 @@ obf_init(enum mmap_e type, const char *dir, size_t secparam, size_t kappa,
             fprintf(stderr, "  Using dual input branching programs\n");
         if (s->flags & OBFUSCATOR_FLAG_NO_RANDOMIZATION)
             fprintf(stderr, "  Not randomizing branching programs\n");
+        if (s->flags & OBFUSCATOR_FLAG_RESUME)
+            fprintf(stderr, "  Resuming from checkpoint\n");
     }
 
-    s->mmap = malloc(s->vtable->sk->size);
-    s->vtable->sk->init(s->mmap, secparam, kappa, nzs, NULL, 0, ncores, s->rand,
-                        s->flags & OBFUSCATOR_FLAG_VERBOSE);
-    {
+    if (!(s->flags & OBFUSCATOR_FLAG_RESUME)) {
+        s->mmap = malloc(s->vtable->sk->size);
+        s->vtable->sk->init(s->mmap, secparam, kappa, nzs, NULL, 0, ncores,
+                            s->rand, s->flags & OBFUSCATOR_FLAG_VERBOSE);
+        if (s->flags & OBFUSCATOR_FLAG_CHECKPOINT
+            && obf_write_state(s) == OBFUSCATOR_ERR) {
+            obf_clear(s);
+            return NULL;
+        }
+    }
+    if (s->flags & OBFUSCATOR_FLAG_CONTAINER) {
+        if ((s->container = container_create(dir)) == NULL) {
+            obf_clear(s);
+            return NULL;
+        }
+        container_write_params(s->container, s->vtable,
+                               s->vtable->sk->pp(s->mmap));
+    } else {
         FILE *fp = open_file(dir, "params", "w+b");
         s->vtable->pp->fwrite(s->vtable->sk->pp(s->mmap), fp);
         fclose(fp);
@@ -135,6 +315,22 @@ obf_init(enum mmap_e type, const char *dir, size_t secparam, size_t kappa,
     return s;
 }
 
+static void
+obf_chain_clear(obf_state_t *s)
+{
+    for (uint64_t b = 0; b < s->nlinks; ++b) {
+        if (s->chain[b].n == 0)
+            continue;
+        if (!s->chain[b].randomizer_used)
+            fmpz_mat_clear(s->chain[b].randomizer);
+        if (!s->chain[b].inverse_used)
+            fmpz_mat_clear(s->chain[b].inverse);
+    }
+    free(s->chain);
+    s->chain = NULL;
+    s->nlinks = 0;
+}
+
 void
 obf_clear(obf_state_t *s)
 {
@@ -142,17 +338,42 @@ obf_clear(obf_state_t *s)
         s->vtable->sk->clear(s->mmap);
         free(s->mmap);
         aes_randclear(s->rand);
-        for (uint64_t i = 0; i < s->nthreads; ++i) {
-            aes_randclear(s->rands[i]);
-        }
-        free(s->rands);
-        free(s->randomizer);
-        free(s->inverse);
         thpool_destroy(s->thpool);
+        /* left over if the layer that needed it failed */
+        if (s->inverse_held)
+            fmpz_mat_clear(*s->inverse);
+        free(s->inverse);
+        obf_chain_clear(s);
+        budget_clear(&s->budget);
+        snapshot_clear(&s->snapshot);
+        container_close(s->container);
     }
     free(s);
 }
 
+/*
+ * Seeds rand with the stream for (layer, slot), derived from the seed alone
+ * so that what is drawn from it does not depend on the number of threads or
+ * the order jobs run in.  OBF_RAND_ALL in place of a slot names the stream
+ * shared by the whole layer, and OBF_RAND_RANDOMIZER the stream of the
+ * randomizer following the layer.
+ *
+ * This only covers Kilian randomization and the slot scalars.  The mmap
+ * encodes with randomness drawn from the secret key's own state, in the order
+ * the encode jobs happen to run, so with CLT or GGHLite a seeded obfuscation
+ * is only reproducible as a whole when run with a single thread; the dummy
+ * mmap, which draws nothing, gives the same output for any thread count.
+ */
+static void
+obf_randinit_stream(obf_state_t *s, aes_randstate_t rand, uint64_t layer,
+                    uint64_t slot)
+{
+    uint64_t additional[2] = { layer, slot };
+
+    aes_randinit_seedn(rand, (char *) s->seed, AES_SEED_BYTE_SIZE,
+                       (char *) additional, sizeof additional);
+}
+
 static void
 _fmpz_mat_init_square_rand(obf_state_t *s, fmpz_mat_t mat, fmpz_mat_t inverse,
                            long n, aes_randstate_t rand, fmpz_t field)
@@ -170,335 +391,807 @@ _fmpz_mat_init_square_rand(obf_state_t *s, fmpz_mat_t mat, fmpz_mat_t inverse,
     } while (singular);
 }
 
-static void
-_fmpz_mat_init_diagonal_rand(fmpz_mat_t mat, long n, aes_randstate_t rand,
-                             fmpz_t field)
+/*
+ * Returns the n diagonal entries of a random invertible diagonal matrix;
+ * only the diagonal is ever stored.
+ */
+static fmpz_t *
+_diagonal_init_rand(long n, aes_randstate_t rand, fmpz_t field)
 {
-    fmpz_mat_init(mat, n, n);
-    fmpz_mat_one(mat);
+    fmpz_t *diag;
+
+    diag = calloc(n, sizeof(fmpz_t));
     for (int i = 0; i < n; i++) {
+        fmpz_init(diag[i]);
         do {
-            fmpz_randm_aes(fmpz_mat_entry(mat, i, i), rand, field);
-        } while (fmpz_cmp_ui(fmpz_mat_entry(mat, i, i), 0) == 0);
+            fmpz_randm_aes(diag[i], rand, field);
+        } while (fmpz_cmp_ui(diag[i], 0) == 0);
     }
+    return diag;
 }
 
-static inline void
-fmpz_mat_mul_mod(fmpz_mat_t a, fmpz_mat_t b, fmpz_mat_t c, fmpz_t p)
+static void
+_diagonal_clear(fmpz_t *diag, long n)
 {
-    fmpz_mat_mul(a, b, c);
-    fmpz_mat_scalar_mod_fmpz(a, a, p);
+    for (int i = 0; i < n; i++) {
+        fmpz_clear(diag[i]);
+    }
+    free(diag);
 }
 
-static inline void
-fmpz_layer_mul_left(uint64_t n, fmpz_mat_t *mats, fmpz_mat_t m, fmpz_t p)
+/*
+ * Sets inverse to the inverse of the unit lower triangular matrix lower by
+ * forward substitution.
+ */
+static void
+_unit_lower_inverse(fmpz_mat_t inverse, const fmpz_mat_t lower, long n,
+                    fmpz_t field)
 {
-    for (uint64_t i = 0; i < n; ++i) {
-        fmpz_mat_mul_mod(mats[i], m, mats[i], p);
+    fmpz_t acc;
+
+    fmpz_init(acc);
+    fmpz_mat_one(inverse);
+    for (long j = 0; j < n; j++) {
+        for (long i = j + 1; i < n; i++) {
+            fmpz_zero(acc);
+            for (long k = j; k < i; k++) {
+                fmpz_addmul(acc, fmpz_mat_entry(lower, i, k),
+                            fmpz_mat_entry(inverse, k, j));
+            }
+            fmpz_neg(acc, acc);
+            fmpz_mod(fmpz_mat_entry(inverse, i, j), acc, field);
+        }
     }
+    fmpz_clear(acc);
 }
 
+/*
+ * Sets mat to a random L * D * U, with L unit lower triangular, D diagonal
+ * and U unit upper triangular, and inverse to U^-1 * D^-1 * L^-1.  Each
+ * factor is inverted directly, so unlike _fmpz_mat_init_square_rand there is
+ * no elimination and no retry on a singular draw.  This samples uniformly
+ * from the invertible matrices whose leading principal minors are nonzero,
+ * which is all but about an n/p fraction of them.
+ */
 static void
-fmpz_layer_mul_right(uint64_t n, fmpz_mat_t *mats, fmpz_mat_t m, fmpz_t p)
+_fmpz_mat_init_ldu_rand(fmpz_mat_t mat, fmpz_mat_t inverse, long n,
+                        aes_randstate_t rand, fmpz_t field)
 {
-    for (uint64_t i = 0; i < n; ++i) {
-        fmpz_mat_mul_mod(mats[i], mats[i], m, p);
+    fmpz_mat_t lower, upper, lower_inv, upper_inv, tmp;
+    fmpz_t *diag;
+
+    fmpz_mat_init(lower, n, n);
+    fmpz_mat_init(upper, n, n);
+    fmpz_mat_init(lower_inv, n, n);
+    fmpz_mat_init(upper_inv, n, n);
+    fmpz_mat_init(tmp, n, n);
+
+    fmpz_mat_one(lower);
+    for (long i = 0; i < n; i++) {
+        for (long j = 0; j < i; j++) {
+            fmpz_randm_aes(fmpz_mat_entry(lower, i, j), rand, field);
+        }
+    }
+    diag = _diagonal_init_rand(n, rand, field);
+    /* U is kept transposed so both triangles invert by forward substitution */
+    fmpz_mat_one(upper);
+    for (long i = 0; i < n; i++) {
+        for (long j = 0; j < i; j++) {
+            fmpz_randm_aes(fmpz_mat_entry(upper, i, j), rand, field);
+        }
+    }
+
+    _unit_lower_inverse(lower_inv, lower, n, field);
+    _unit_lower_inverse(tmp, upper, n, field);
+    fmpz_mat_transpose(upper_inv, tmp);
+    fmpz_mat_transpose(tmp, upper);
+    fmpz_mat_swap(upper, tmp);
+
+    /* mat = L * (D * U) */
+    for (long i = 0; i < n; i++) {
+        for (long j = 0; j < n; j++) {
+            fmpz_mul(fmpz_mat_entry(tmp, i, j), fmpz_mat_entry(upper, i, j),
+                     diag[i]);
+        }
+    }
+    fmpz_mat_mul(mat, lower, tmp);
+    fmpz_mat_scalar_mod_fmpz(mat, mat, field);
+
+    /* inverse = U^-1 * (D^-1 * L^-1) */
+    for (long i = 0; i < n; i++) {
+        fmpz_invmod(diag[i], diag[i], field);
+        for (long j = 0; j < n; j++) {
+            fmpz_mul(fmpz_mat_entry(tmp, i, j),
+                     fmpz_mat_entry(lower_inv, i, j), diag[i]);
+        }
     }
+    fmpz_mat_mul(inverse, upper_inv, tmp);
+    fmpz_mat_scalar_mod_fmpz(inverse, inverse, field);
+
+    _diagonal_clear(diag, n);
+    fmpz_mat_clear(lower);
+    fmpz_mat_clear(upper);
+    fmpz_mat_clear(lower_inv);
+    fmpz_mat_clear(upper_inv);
+    fmpz_mat_clear(tmp);
 }
 
+/*
+ * Initializes randomizer to the random invertible ncols x ncols matrix
+ * between layers b and b + 1 and inverse to its inverse.  It is drawn from
+ * its own stream, so the chain comes out the same whether drawn layer by
+ * layer or up front.
+ */
 static void
-obf_randomize_layer(obf_state_t *s, long nrows, long ncols,
-                    encode_layer_randomization_flag_t rflag,
-                    uint64_t n, fmpz_mat_t *mats)
+obf_draw_randomizer(obf_state_t *s, uint64_t b, long ncols,
+                    fmpz_mat_t randomizer, fmpz_mat_t inverse, fmpz_t field)
 {
-    fmpz_t *fields;
+    aes_randstate_t rand;
 
-    fields = s->vtable->sk->plaintext_fields(s->mmap);
+    obf_randinit_stream(s, rand, b, OBF_RAND_RANDOMIZER);
+    fmpz_mat_init(randomizer, ncols, ncols);
+    fmpz_mat_init(inverse, ncols, ncols);
+    if (s->flags & OBFUSCATOR_FLAG_LDU_RANDOMIZER)
+        _fmpz_mat_init_ldu_rand(randomizer, inverse, ncols, rand, field);
+    else
+        _fmpz_mat_init_square_rand(s, randomizer, inverse, ncols, rand, field);
+    aes_randclear(rand);
+}
 
-    if (rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST) {
-        fmpz_mat_t first;
-        _fmpz_mat_init_diagonal_rand(first, nrows, s->rand, fields[0]);
-        fmpz_layer_mul_left(n, mats, first, fields[0]);
-        fmpz_mat_clear(first);
-    }
-    if (rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_LAST) {
-        fmpz_mat_t last;
-        _fmpz_mat_init_diagonal_rand(last, ncols, s->rand, fields[0]);
-        fmpz_layer_mul_right(n, mats, last, fields[0]);
-        fmpz_mat_clear(last);
-    }
-
-    if (rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST
-        && rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_LAST) {
-    } else if (rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST) {
-        fmpz_mat_init(*s->randomizer, ncols, ncols);
-        fmpz_mat_init(*s->inverse, ncols, ncols);
-        _fmpz_mat_init_square_rand(s, *s->randomizer, *s->inverse, ncols,
-                                   s->rand, fields[0]);
-        fmpz_layer_mul_right(n, mats, *s->randomizer, fields[0]);
-    } else if (rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_MIDDLE) {
-        fmpz_layer_mul_left(n, mats, *s->inverse, fields[0]);
-        fmpz_mat_clear(*s->randomizer);
-        fmpz_mat_clear(*s->inverse);
+/*
+ * One side of a layer's randomization: a dense matrix, a diagonal matrix
+ * given by its entries, or the identity when both are NULL.
+ */
+struct randomizer_s {
+    const fmpz_mat_struct *dense;
+    fmpz_t *diag;
+};
 
-        fmpz_mat_init(*s->randomizer, ncols, ncols);
-        fmpz_mat_init(*s->inverse, ncols, ncols);
-        _fmpz_mat_init_square_rand(s, *s->randomizer, *s->inverse, ncols,
-                                   s->rand, fields[0]);
-        fmpz_layer_mul_right(n, mats, *s->randomizer, fields[0]);
-    } else if (rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_LAST) {
-        fmpz_layer_mul_left(n, mats, *s->inverse, fields[0]);
-        fmpz_mat_clear(*s->randomizer);
-        fmpz_mat_clear(*s->inverse);
+/*
+ * Sets rows to rows r0..r1 of left * m, touching only the nonzero entries of
+ * m.  Worthwhile for the 0/1 branching program matrices, which are sparse.
+ */
+static void
+sparse_mul_rows(fmpz_mat_t rows, const fmpz_mat_struct *left, long r0,
+                long r1, const fmpz_mat_t m)
+{
+    fmpz_mat_zero(rows);
+    for (long k = 0; k < m->r; ++k) {
+        for (long j = 0; j < m->c; ++j) {
+            const fmpz *e = fmpz_mat_entry(m, k, j);
+            if (fmpz_is_zero(e))
+                continue;
+            for (long i = r0; i < r1; ++i) {
+                if (fmpz_is_one(e))
+                    fmpz_add(fmpz_mat_entry(rows, i - r0, j),
+                             fmpz_mat_entry(rows, i - r0, j),
+                             fmpz_mat_entry(left, i, k));
+                else
+                    fmpz_addmul(fmpz_mat_entry(rows, i - r0, j),
+                                fmpz_mat_entry(left, i, k), e);
+            }
+        }
+    }
+}
+
+static bool
+is_sparse(const fmpz_mat_t m)
+{
+    long nonzero = 0;
+
+    for (long i = 0; i < m->r; ++i) {
+        for (long j = 0; j < m->c; ++j) {
+            if (!fmpz_is_zero(fmpz_mat_entry(m, i, j)))
+                nonzero++;
+        }
+    }
+    return nonzero * RANDOMIZE_SPARSE_RATIO <= m->r * m->c;
+}
+
+/* Whether a layer is multiplied on the left by the previous randomizer */
+static inline bool
+randomizes_in(encode_layer_randomization_flag_t rflag)
+{
+    return !(rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST)
+        && rflag & (ENCODE_LAYER_RANDOMIZATION_TYPE_MIDDLE
+                    | ENCODE_LAYER_RANDOMIZATION_TYPE_LAST);
+}
+
+/* Whether a layer is multiplied on the right by a randomizer */
+static inline bool
+randomizes_out(encode_layer_randomization_flag_t rflag)
+{
+    return !(rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_LAST)
+        && rflag & (ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST
+                    | ENCODE_LAYER_RANDOMIZATION_TYPE_MIDDLE);
+}
+
+/*
+ * Sets mats[c] to alphas[c] * left * mats[c] * right mod p for each of the n
+ * slots.  Every block of RANDOMIZE_BLOCK_ROWS output rows of every slot is an
+ * independent iteration spread over ncores OpenMP threads.  Diagonal sides are
+ * applied as row and column scalings, a dense left side exploits sparse slot
+ * matrices, and the right side and scalar are fused with a single final
+ * reduction.
+ *
+ * p spans many words, so there is no word-sized modular multiply to delay
+ * reductions in; instead products are accumulated exactly by fmpz_mat_mul and
+ * each entry is reduced once per side.
+ */
+static void
+randomize_mats(uint64_t n, fmpz_mat_t *mats, struct randomizer_s left,
+               struct randomizer_s right, fmpz_t *alphas, fmpz_t p,
+               uint64_t ncores)
+{
+    const long nrows = left.dense ? left.dense->r : mats[0]->r;
+    const long ncols = right.dense ? right.dense->c : mats[0]->c;
+    const long nblocks = (nrows + RANDOMIZE_BLOCK_ROWS - 1)
+        / RANDOMIZE_BLOCK_ROWS;
+    fmpz_mat_t *out, *scale = NULL;
+    bool *sparse = NULL;
+
+    out = calloc(n, sizeof(fmpz_mat_t));
+    for (uint64_t c = 0; c < n; ++c) {
+        fmpz_mat_init(out[c], nrows, ncols);
+    }
+    if (left.dense) {
+        sparse = calloc(n, sizeof(bool));
+        for (uint64_t c = 0; c < n; ++c) {
+            sparse[c] = is_sparse(mats[c]);
+        }
+    }
+    if (right.diag) {
+        /* column scaling with the slot scalar folded in */
+        scale = calloc(n, sizeof(fmpz_mat_t));
+        for (uint64_t c = 0; c < n; ++c) {
+            fmpz_mat_init(scale[c], 1, ncols);
+            for (long j = 0; j < ncols; ++j) {
+                fmpz *e = fmpz_mat_entry(scale[c], 0, j);
+                fmpz_mul(e, right.diag[j], alphas[c]);
+                fmpz_mod(e, e, p);
+            }
+        }
     }
 
-    {
-        fmpz_t alpha;
-        fmpz_init(alpha);
-        for (uint64_t i = 0; i < n; ++i) {
-            do {
-                fmpz_randm_aes(alpha, s->rand, fields[0]);
-            } while (fmpz_cmp_ui(alpha, 0) == 0);
-            fmpz_mat_scalar_mul_fmpz(mats[i], mats[i], alpha);
+#pragma omp parallel for schedule(dynamic) num_threads(ncores)
+    for (long k = 0; k < (long) n * nblocks; ++k) {
+        const long c = k / nblocks;
+        const long r0 = (k % nblocks) * RANDOMIZE_BLOCK_ROWS;
+        const long r1 = r0 + RANDOMIZE_BLOCK_ROWS > nrows
+            ? nrows : r0 + RANDOMIZE_BLOCK_ROWS;
+        fmpz_mat_t rows, block;
+
+        /* rows r0..r1 of left * mats[c] */
+        if (left.dense) {
+            fmpz_mat_init(rows, r1 - r0, mats[c]->c);
+            if (sparse[c]) {
+                sparse_mul_rows(rows, left.dense, r0, r1, mats[c]);
+            } else {
+                fmpz_mat_t window;
+                fmpz_mat_window_init(window, left.dense, r0, 0, r1,
+                                     left.dense->c);
+                fmpz_mat_mul(rows, window, mats[c]);
+                fmpz_mat_window_clear(window);
+            }
+            fmpz_mat_scalar_mod_fmpz(rows, rows, p);
+        } else if (left.diag) {
+            fmpz_mat_init(rows, r1 - r0, mats[c]->c);
+            for (long i = r0; i < r1; ++i) {
+                for (long j = 0; j < mats[c]->c; ++j) {
+                    fmpz *e = fmpz_mat_entry(rows, i - r0, j);
+                    fmpz_mul(e, fmpz_mat_entry(mats[c], i, j),
+                             left.diag[i]);
+                    fmpz_mod(e, e, p);
+                }
+            }
+        } else {
+            fmpz_mat_window_init(rows, mats[c], r0, 0, r1, mats[c]->c);
         }
-        fmpz_clear(alpha);
+
+        fmpz_mat_window_init(block, out[c], r0, 0, r1, ncols);
+        if (right.dense) {
+            fmpz_mat_mul(block, rows, right.dense);
+            fmpz_mat_scalar_mul_fmpz(block, block, alphas[c]);
+            fmpz_mat_scalar_mod_fmpz(block, block, p);
+        } else if (right.diag) {
+            for (long i = 0; i < r1 - r0; ++i) {
+                for (long j = 0; j < ncols; ++j) {
+                    fmpz *e = fmpz_mat_entry(block, i, j);
+                    fmpz_mul(e, fmpz_mat_entry(rows, i, j),
+                             fmpz_mat_entry(scale[c], 0, j));
+                    fmpz_mod(e, e, p);
+                }
+            }
+        } else {
+            fmpz_mat_scalar_mul_fmpz(block, rows, alphas[c]);
+            fmpz_mat_scalar_mod_fmpz(block, block, p);
+        }
+        fmpz_mat_window_clear(block);
+
+        if (left.dense || left.diag)
+            fmpz_mat_clear(rows);
+        else
+            fmpz_mat_window_clear(rows);
+    }
+
+    for (uint64_t c = 0; c < n; ++c) {
+        fmpz_mat_swap(mats[c], out[c]);
+        fmpz_mat_clear(out[c]);
+        if (scale)
+            fmpz_mat_clear(scale[c]);
+    }
+    free(out);
+    free(scale);
+    free(sparse);
+}
+
+/*
+ * Kilian-randomizes a layer: the first layer is multiplied on the left by a
+ * random diagonal matrix and the last on the right by another, each layer
+ * but the last on the right by a random invertible matrix and the next one
+ * on the left by its inverse, and every slot matrix by its own random scalar.
+ * Without a chain from obf_randomizer_chain the randomizer is drawn here and
+ * its inverse left in s->inverse for the next layer, or, if that layer was
+ * skipped on resume, drawn again by the one after it.
+ */
+static void
+obf_randomize_layer(obf_state_t *s, long idx, long nrows, long ncols,
+                    encode_layer_randomization_flag_t rflag, bool redraw,
+                    uint64_t n, fmpz_mat_t *mats)
+{
+    const bool first = rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_FIRST;
+    const bool last = rflag & ENCODE_LAYER_RANDOMIZATION_TYPE_LAST;
+    const bool chain_in = randomizes_in(rflag);
+    const bool chain_out = randomizes_out(rflag);
+    fmpz_t *fields, *alphas;
+    aes_randstate_t rand;
+    fmpz_mat_t randomizer, inverse;
+    struct randomizer_s left = { NULL, NULL }, right = { NULL, NULL };
+    uint64_t nactive;
+
+    fields = s->vtable->sk->plaintext_fields(s->mmap);
+    obf_randinit_stream(s, rand, idx, OBF_RAND_ALL);
+
+    if (first)
+        left.diag = _diagonal_init_rand(nrows, rand, fields[0]);
+    if (last)
+        right.diag = _diagonal_init_rand(ncols, rand, fields[0]);
+    if (chain_in && redraw && s->chain == NULL) {
+        fmpz_mat_t skipped;
+        if (s->inverse_held)
+            fmpz_mat_clear(*s->inverse);
+        obf_draw_randomizer(s, idx - 1, nrows, skipped, *s->inverse,
+                            fields[0]);
+        fmpz_mat_clear(skipped);
+    }
+    if (chain_in)
+        left.dense = s->chain ? s->chain[idx - 1].inverse : *s->inverse;
+    if (chain_out) {
+        if (s->chain == NULL)
+            obf_draw_randomizer(s, idx, ncols, randomizer, inverse, fields[0]);
+        right.dense = s->chain ? s->chain[idx].randomizer : randomizer;
+    }
+
+    alphas = calloc(n, sizeof(fmpz_t));
+    for (uint64_t i = 0; i < n; ++i) {
+        aes_randstate_t slot_rand;
+        obf_randinit_stream(s, slot_rand, idx, i);
+        fmpz_init(alphas[i]);
+        do {
+            fmpz_randm_aes(alphas[i], slot_rand, fields[0]);
+        } while (fmpz_cmp_ui(alphas[i], 0) == 0);
+        aes_randclear(slot_rand);
     }
 
+    /*
+     * This runs in a thread pool worker, so the OpenMP team comes on top of
+     * the pool's threads: share the cores between the randomization jobs
+     * running at once rather than giving each all of them.
+     */
+    nactive = atomic_fetch_add(&s->randomizing, 1) + 1;
+    randomize_mats(n, mats, left, right, alphas, fields[0],
+                   s->ncores / nactive > 0 ? s->ncores / nactive : 1);
+    atomic_fetch_sub(&s->randomizing, 1);
+
+    if (first)
+        _diagonal_clear(left.diag, nrows);
+    if (last)
+        _diagonal_clear(right.diag, ncols);
+    if (chain_in && s->chain) {
+        fmpz_mat_clear(s->chain[idx - 1].inverse);
+        s->chain[idx - 1].inverse_used = true;
+    } else if (chain_in) {
+        fmpz_mat_clear(*s->inverse);
+        s->inverse_held = false;
+    }
+    if (chain_out && s->chain) {
+        fmpz_mat_clear(s->chain[idx].randomizer);
+        s->chain[idx].randomizer_used = true;
+    } else if (chain_out) {
+        fmpz_mat_clear(randomizer);
+        **s->inverse = *inverse;
+        s->inverse_held = true;
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+        fmpz_clear(alphas[i]);
+    }
+    free(alphas);
+    aes_randclear(rand);
     free(fields);
 }
 
+/*
+ * Sets up the output stream of each slot matrix and adds a completion group
+ * of the layer's n * ntiles encode jobs that finishes writing the layer once
+ * they have all run, returning its handle or -1 on error.  Slot files are
+ * only opened once their first tile is written.
+ */
 static int
 add_work_write_layer(obf_state_t *s, uint64_t n, long inp, long idx,
-                     long nrows, long ncols, char **names, char *tag,
-                     mmap_enc_mat_t **enc_mats)
+                     long nrows, long ncols, fmpz_mat_t *mats, long ntiles,
+                     uint64_t bytes, struct write_layer_s **wl)
 {
     struct write_layer_s *wl_s;
-    wl_s = malloc(sizeof(struct write_layer_s));
+    uint64_t c;
+    int group;
+
+    wl_s = calloc(1, sizeof(struct write_layer_s));
     wl_s->vtable = s->vtable;
     wl_s->dir = s->dir;
+    wl_s->container = s->container;
     wl_s->n = n;
-    wl_s->enc_mats = enc_mats;
-    wl_s->names = names;
+    wl_s->mats = mats;
+    wl_s->streams = calloc(n, sizeof(struct matrix_stream_s));
+    wl_s->bufs = calloc(n, sizeof(char *));
+    wl_s->lens = calloc(n, sizeof(size_t));
     wl_s->inp = inp;
     wl_s->idx = idx;
     wl_s->nrows = nrows;
     wl_s->ncols = ncols;
     wl_s->start = current_time();
     wl_s->verbose = s->flags & OBFUSCATOR_FLAG_VERBOSE;
-    if (thpool_add_tag(s->thpool, tag, n * nrows * ncols,
-                       thpool_write_layer, wl_s) == OBFUSCATOR_ERR) {
-        free(wl_s);
+    wl_s->budget = &s->budget;
+    wl_s->bytes = bytes;
+    wl_s->checkpoint = s->flags & (OBFUSCATOR_FLAG_CHECKPOINT
+                                   | OBFUSCATOR_FLAG_RESUME);
+    wl_s->save_state = obf_save_state;
+    wl_s->state = s;
+
+    for (c = 0; c < n; ++c) {
+        FILE *fp = NULL;
+
+        if (s->container
+            && (fp = open_memstream(&wl_s->bufs[c], &wl_s->lens[c])) == NULL)
+            goto error;
+        if (matrix_stream_init(&wl_s->streams[c], fp, s->dir, idx, c, ntiles)
+            == OBFUSCATOR_ERR) {
+            if (fp)
+                fclose(fp);
+            goto error;
+        }
+    }
+
+    group = thpool_add_group(s->thpool, n * ntiles, idx, thpool_write_layer,
+                             wl_s);
+    if (group == -1)
+        goto error;
+    *wl = wl_s;
+    return group;
+
+error:
+    while (c-- > 0) {
+        if (wl_s->streams[c].fp)
+            fclose(wl_s->streams[c].fp);
+        matrix_stream_clear(&wl_s->streams[c]);
+        free(wl_s->bufs[c]);
+    }
+    free(wl_s->streams);
+    free(wl_s->bufs);
+    free(wl_s->lens);
+    free(wl_s);
+    return -1;
+}
+
+static void *
+thpool_randomize_layer(void *vargs)
+{
+    struct randomize_layer_s *args = (struct randomize_layer_s *) vargs;
+    double start, end;
+
+    start = current_time();
+    obf_randomize_layer(args->s, args->idx, args->nrows, args->ncols,
+                        args->rflag, args->redraw, args->n, args->mats);
+    end = current_time();
+    if (args->s->flags & OBFUSCATOR_FLAG_VERBOSE)
+        (void) fprintf(stderr, "  Randomizing matrix: %f\n", end - start);
+    free(args);
+
+    return NULL;
+}
+
+/*
+ * Adds the job randomizing the layer to `group`, a group of one job.  Without
+ * a precomputed chain it runs after the previous layer's randomization, which
+ * leaves the randomizer for this one.
+ */
+static int
+add_work_randomize_layer(obf_state_t *s, uint64_t n, long nrows, long ncols,
+                         fmpz_mat_t *mats, long idx,
+                         encode_layer_randomization_flag_t rflag, bool redraw,
+                         int group)
+{
+    struct randomize_layer_s *args;
+
+    if ((args = malloc(sizeof(struct randomize_layer_s))) == NULL)
+        return OBFUSCATOR_ERR;
+    args->s = s;
+    args->idx = idx;
+    args->n = n;
+    args->nrows = nrows;
+    args->ncols = ncols;
+    args->mats = mats;
+    args->rflag = rflag;
+    args->redraw = redraw;
+    if (thpool_add_work_after(s->thpool, thpool_randomize_layer, args, group,
+                              s->chain ? -1 : s->randomized) == -1) {
+        free(args);
         return OBFUSCATOR_ERR;
     }
+    s->randomized = group;
     return OBFUSCATOR_OK;
 }
 
-static void
-add_work(obf_state_t *s, fmpz_mat_t *mats, mmap_enc_mat_t **enc_mats,
-         int **pows, long c, long i, long j, char *tag)
+/*
+ * Queues the encoding of rows [row, row + nrows) of matrix c as tile `tile`
+ * of its stream, to run once the layer has been randomized.
+ */
+static int
+add_work(obf_state_t *s, fmpz_mat_t *mats, struct write_layer_s *wl,
+         int **pows, long c, long tile, long row, long nrows, int group,
+         int after)
 {
-    fmpz_t *plaintext;
-    mmap_enc *enc;
-    struct encode_elem_s *args;
-
-    plaintext = malloc(sizeof(fmpz_t));
-    args = malloc(sizeof(struct encode_elem_s));
-    fmpz_init_set(*plaintext, fmpz_mat_entry(mats[c], i, j));
-    enc = enc_mats[c][0]->m[i][j];
-    args->group = pows[c];
-    args->n = 1;
-    args->plaintext = plaintext;
+    struct encode_tile_s *args;
+
+    if ((args = malloc(sizeof(struct encode_tile_s))) == NULL)
+        return OBFUSCATOR_ERR;
     args->vtable = s->vtable;
     args->sk = s->mmap;
-    args->enc = enc;
-    args->rand = &s->rand;
+    args->mat = mats[c];
+    args->row = row;
+    args->nrows = nrows;
+    args->group = pows[c];
+    args->stream = &wl->streams[c];
+    args->tile = tile;
+    args->snapshot = wl->checkpoint ? &s->snapshot : NULL;
 
-    thpool_add_work(s->thpool, thpool_encode_elem, (void *) args, tag);
+    if (thpool_add_work_after(s->thpool, thpool_encode_tile, (void *) args,
+                              group, after) == -1) {
+        free(args);
+        return OBFUSCATOR_ERR;
+    }
+    return OBFUSCATOR_OK;
 }
 
+/*
+ * Gives up on a layer whose jobs could not all be added.  Its streams are
+ * marked failed, so the tiles already added skip encoding, the randomization
+ * they wait for is counted as done, and so are the `nskip` tiles never added.
+ * thpool_write_layer then frees the layer without writing it once the added
+ * tiles have run, which may be before this returns.
+ */
+static void
+abandon_layer(obf_state_t *s, struct write_layer_s *wl, int group, long nskip,
+              int randomized)
+{
+    fprintf(stderr, "error: unable to queue layer %ld\n", wl->idx);
+    for (uint64_t c = 0; c < wl->n; ++c) {
+        pthread_mutex_lock(&wl->streams[c].lock);
+        wl->streams[c].failed = true;
+        pthread_mutex_unlock(&wl->streams[c].lock);
+    }
+    if (randomized != -1)
+        (void) thpool_skip_work(s->thpool, randomized, 1);
+    (void) thpool_skip_work(s->thpool, group, nskip);
+}
+
+/*
+ * Queues the randomization, encoding and writing of a layer and returns
+ * without waiting for them, once the layer fits in the in-flight budget.  The
+ * matrices are copied, so the caller may free mats straight away.
+ */
 int
 obf_encode_layer(obf_state_t *s, uint64_t n, int **pows, fmpz_mat_t *mats,
                  long idx, long inp, encode_layer_randomization_flag_t rflag)
 {
-    char tag[10];
-    mmap_enc_mat_t **enc_mats;
-    char **names;
-    mmap_ro_pp pp = s->vtable->sk->pp(s->mmap);
-    long nrows, ncols;
+    struct write_layer_s *wl;
+    fmpz_mat_t *copies;
+    long nrows, ncols, tilerows, ntiles, nskip;
+    uint64_t bytes;
+    int group, randomized = -1;
+    bool redraw;
 
     /* TODO: check for mismatched matrices */
 
     nrows = mats[0]->r;
     ncols = mats[0]->c;
 
-    (void) snprintf(tag, 10, "%ld", idx);
+    if (s->chain && !(s->flags & OBFUSCATOR_FLAG_NO_RANDOMIZATION)) {
+        if ((randomizes_in(rflag)
+             && (idx < 1 || (uint64_t) idx > s->nlinks
+                 || s->chain[idx - 1].n != nrows))
+            || (randomizes_out(rflag)
+                && (idx < 0 || (uint64_t) idx >= s->nlinks
+                    || s->chain[idx].n != ncols))) {
+            fprintf(stderr, "error: randomizer chain does not cover layer %ld\n",
+                    idx);
+            return OBFUSCATOR_ERR;
+        }
+    }
 
-    if (!(s->flags & OBFUSCATOR_FLAG_NO_RANDOMIZATION)) {
-        double start, end;
-        start = current_time();
-        obf_randomize_layer(s, nrows, ncols, rflag, n, mats);
-        end = current_time();
+    if (s->flags & OBFUSCATOR_FLAG_RESUME && obf_layer_done(s, idx)) {
         if (s->flags & OBFUSCATOR_FLAG_VERBOSE)
-            (void) fprintf(stderr, "  Randomizing matrix: %f\n", end - start);
+            fprintf(stderr, "  Skipping finished layer %ld\n", idx);
+        s->redraw = randomizes_out(rflag);
+        return OBFUSCATOR_OK;
     }
+    redraw = s->redraw;
+    s->redraw = false;
 
-    enc_mats = calloc(n, sizeof(mmap_enc_mat_t *));
-    for (uint64_t c = 0; c < n; ++c) {
-        enc_mats[c] = malloc(sizeof(mmap_enc_mat_t));
-        mmap_enc_mat_init(s->vtable, pp, *enc_mats[c], nrows, ncols);
+    bytes = budget_acquire(&s->budget, n * nrows * ncols);
+
+    if ((copies = calloc(n, sizeof(fmpz_mat_t))) == NULL) {
+        budget_release(&s->budget, bytes, 0);
+        return OBFUSCATOR_ERR;
     }
-    names = calloc(n, sizeof(char *));
     for (uint64_t c = 0; c < n; ++c) {
-        names[c] = calloc(10, sizeof(char));
-        (void) snprintf(names[c], 10, "%lu", c);
+        fmpz_mat_init_set(copies[c], mats[c]);
     }
 
-    if (add_work_write_layer(s, n, inp, idx, nrows, ncols, names, tag, enc_mats)
-        == OBFUSCATOR_ERR)
+    // encode whole rows, at least ENCODE_TILE_SIZE entries per job
+    tilerows = ENCODE_TILE_SIZE / ncols;
+    if (tilerows < 1)
+        tilerows = 1;
+    if (tilerows > nrows)
+        tilerows = nrows;
+    ntiles = (nrows + tilerows - 1) / tilerows;
+
+    group = add_work_write_layer(s, n, inp, idx, nrows, ncols, copies, ntiles,
+                                 bytes, &wl);
+    if (group == -1) {
+        for (uint64_t c = 0; c < n; ++c) {
+            fmpz_mat_clear(copies[c]);
+        }
+        free(copies);
+        budget_release(&s->budget, bytes, 0);
         return OBFUSCATOR_ERR;
+    }
+
+    /*
+     * From here on the write group owns copies and wl.  The tiles are held
+     * back by the randomization group before its job is added, so that a
+     * layer that cannot be queued in full is never randomized or encoded.
+     */
+    nskip = n * ntiles;
+    if (!(s->flags & OBFUSCATOR_FLAG_NO_RANDOMIZATION)) {
+        randomized = thpool_add_group(s->thpool, 1, idx, NULL, NULL);
+        if (randomized == -1)
+            goto abandon;
+    }
 
     for (uint64_t c = 0; c < n; ++c) {
-        for (long i = 0; i < nrows; ++i) {
-            for (long j = 0; j < ncols; ++j) {
-                add_work(s, mats, enc_mats, pows, c, i, j, tag);
-            }
+        for (long t = 0; t < ntiles; ++t) {
+            long row = t * tilerows;
+            if (add_work(s, copies, wl, pows, c, t, row,
+                         row + tilerows > nrows ? nrows - row : tilerows,
+                         group, randomized) == OBFUSCATOR_ERR)
+                goto abandon;
+            nskip--;
         }
     }
 
+    if (randomized != -1
+        && add_work_randomize_layer(s, n, nrows, ncols, copies, idx, rflag,
+                                    redraw, randomized) == OBFUSCATOR_ERR)
+        goto abandon;
+
     return OBFUSCATOR_OK;
+
+abandon:
+    abandon_layer(s, wl, group, nskip, randomized);
+    /* as for a skipped layer, the next one draws its own inverse */
+    s->redraw = randomizes_out(rflag);
+    return OBFUSCATOR_ERR;
 }
 
 int
-obf_evaluate(enum mmap_e type, char *dir, uint64_t len, uint64_t *input,
-             uint64_t bplen, uint64_t ncores, bool verbose)
+obf_randomizer_chain(obf_state_t *s, uint64_t nlayers, const long *ncols,
+                     uint64_t start, uint64_t end)
 {
-    const mmap_vtable *vtable;
-    mmap_pp pp;
-    FILE *fp;
-    mmap_enc_mat_t *result = NULL;
-    uint64_t nrows, ncols, nrows_prev = 0;
-    int err = 1, iszero = -1;
-    double start, end;
-
-    (void) ncores;
-
-    switch (type) {
-    case MMAP_DUMMY:
-        vtable = &dummy_vtable;
-        break;
-    case MMAP_CLT:
-        vtable = &clt_vtable;
-        break;
-    case MMAP_GGHLITE:
-        vtable = &gghlite_vtable;
-        break;
-    default:
-        return err;
-    }
-
-    if(NULL == (pp = malloc(vtable->pp->size)))
-        goto done;
-    if ((fp = open_file(dir, "params", "r+b")) == NULL)
-        goto done;
-    vtable->pp->fread(pp, fp);
-    fclose(fp);
-
-    for (uint64_t layer = 0; layer < bplen; ++layer) {
-        uint64_t inp;
-        char str[10];
-        mmap_enc_mat_t *left, *right;
-
-        start = current_time();
-
-        // determine the size of the matrix
-        if ((fp = open_indexed_file(dir, "nrows", layer, "r+b")) == NULL)
-            goto done;
-        fread(&nrows, sizeof nrows, 1, fp);
-        fclose(fp);
-        if ((fp = open_indexed_file(dir, "ncols", layer, "r+b")) == NULL)
-            goto done;
-        fread(&ncols, sizeof ncols, 1, fp);
-        fclose(fp);
+    fmpz_t *fields;
+    uint64_t first, last;
 
-        // find out the input bit for the given layer
-        if ((fp = open_indexed_file(dir, "input", layer, "r+b")) == NULL)
-            goto done;
-        fread(&inp, sizeof inp, 1, fp);
-        fclose(fp);
+    if (nlayers < 1 || start >= end || end > nlayers) {
+        fprintf(stderr, "error: invalid layer range [%lu, %lu) of %lu\n",
+                start, end, nlayers);
+        return OBFUSCATOR_ERR;
+    }
+    /* each range's process would reuse the same key's encoding randomness */
+    if ((start > 0 || end < nlayers) && s->type != MMAP_DUMMY) {
+        fprintf(stderr, "error: encoding a range of layers needs the dummy "
+                "mmap\n");
+        return OBFUSCATOR_ERR;
+    }
 
-        if (inp > len) {
-            fprintf(stderr, "invalid input: %lu > %ld\n", inp, len);
-            goto done;
-        }
-        // load in appropriate matrix for the given input value
-        (void) snprintf(str, 10, "%lu", input[inp]);
-        if ((fp = open_indexed_file(dir, str, layer, "r+b")) == NULL)
-            goto done;
-
-        if (layer == 0) {
-            result = (mmap_enc_mat_t *) malloc(sizeof(mmap_enc_mat_t));
-            mmap_enc_mat_init(vtable, pp, *result, nrows, ncols);
-            for (uint64_t i = 0; i < nrows; ++i) {
-                for (uint64_t j = 0; j < ncols; ++j) {
-                    vtable->enc->fread(result[0]->m[i][j], fp);
-                }
-            }
-            nrows_prev = nrows;
-        } else {
-            left = result;
-            right = (mmap_enc_mat_t *) malloc(sizeof(mmap_enc_mat_t));
-            mmap_enc_mat_init(vtable, pp, *right, nrows, ncols);
-            for (uint64_t i = 0; i < nrows; ++i) {
-                for (uint64_t j = 0; j < ncols; ++j) {
-                    vtable->enc->fread(right[0]->m[i][j], fp);
-                }
-            }
+    obf_chain_clear(s);
+    s->nlinks = nlayers - 1;
+    s->chain = calloc(s->nlinks, sizeof(struct link_s));
 
-            result = (mmap_enc_mat_t *) malloc(sizeof(mmap_enc_mat_t));
-            mmap_enc_mat_init(vtable, pp, *result, nrows_prev, ncols);
-            mmap_enc_mat_mul_par(vtable, pp, *result, *left, *right);
-            mmap_enc_mat_clear(vtable, *left);
-            mmap_enc_mat_clear(vtable, *right);
-            free(left);
-            free(right);
-        }
+    /* the links read by layers start through end - 1 */
+    first = start > 0 ? start - 1 : 0;
+    last = end < nlayers ? end : nlayers - 1;
 
-        fclose(fp);
+    fields = s->vtable->sk->plaintext_fields(s->mmap);
+#pragma omp parallel for schedule(dynamic) num_threads(s->ncores)
+    for (uint64_t b = first; b < last; ++b) {
+        obf_draw_randomizer(s, b, ncols[b], s->chain[b].randomizer,
+                            s->chain[b].inverse, fields[0]);
+        s->chain[b].n = ncols[b];
+    }
+    free(fields);
 
-        end = current_time();
+    return OBFUSCATOR_OK;
+}
 
-        if (verbose && layer != 0)
-            (void) fprintf(stderr, "  Multiplying matrices: %f\n", end - start);
-    }
-    err = 0;
+int
+obf_checkpoint_remove(obf_state_t *s)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char *fname;
+    int ret = OBFUSCATOR_OK;
 
-done:
-    if (!err) {
-        start = current_time();
-        if (result[0]->nrows == 1 && result[0]->ncols == 1)
-            iszero = vtable->enc->is_zero(result[0]->m[0][0], pp);
-        else
-            iszero = vtable->enc->is_zero(result[0]->m[0][1], pp);
-        end = current_time();
-        if (verbose)
-            (void) fprintf(stderr, "  Zero test: %f\n", end - start);
-    }
+    if ((fname = state_path(s, "state")) == NULL)
+        return OBFUSCATOR_ERR;
+    if (unlink(fname) == -1)
+        ret = OBFUSCATOR_ERR;
+    free(fname);
+    /* left behind if saving the state failed */
+    if ((fname = state_path(s, "state.tmp")) == NULL)
+        return OBFUSCATOR_ERR;
+    if (unlink(fname) == -1 && errno != ENOENT)
+        ret = OBFUSCATOR_ERR;
+    free(fname);
 
-    if (result) {
-        mmap_enc_mat_clear(vtable, *result);
-        free(result);
+    if ((dir = opendir(s->dir)) == NULL)
+        return OBFUSCATOR_ERR;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *ext = strrchr(ent->d_name, '.');
+        if (ext == NULL || strcmp(ext, ".done") != 0)
+            continue;
+        if ((fname = state_path(s, ent->d_name)) == NULL
+            || unlink(fname) == -1)
+            ret = OBFUSCATOR_ERR;
+        free(fname);
     }
+    closedir(dir);
 
-    if (pp) {
-        vtable->pp->clear(pp);
-        free(pp);
-    }
+    return ret;
+}
 
-    return iszero;
+void
+obf_set_budget(obf_state_t *s, uint64_t maxlayers, uint64_t maxbytes)
+{
+    pthread_mutex_lock(&s->budget.lock);
+    s->budget.maxlayers = maxlayers;
+    s->budget.maxbytes = maxbytes;
+    pthread_cond_broadcast(&s->budget.written);
+    pthread_mutex_unlock(&s->budget.lock);
 }
 
 void
 obf_wait(obf_state_t *s)
 {
     thpool_wait(s->thpool);
+    if (s->container)
+        (void) container_finalize(s->container);
 }
@@ -11,12 +11,36 @@
 #define OBFUSCATOR_FLAG_NO_RANDOMIZATION 0x01
 #define OBFUSCATOR_FLAG_DUAL_INPUT_BP 0x02
 #define OBFUSCATOR_FLAG_VERBOSE 0x04
+/* Write the obfuscation to the single file `dir` rather than a directory */
+#define OBFUSCATOR_FLAG_CONTAINER 0x08
+/* Draw Kilian randomizers as products of triangular and diagonal factors,
+ * avoiding a modular matrix inversion per layer */
+#define OBFUSCATOR_FLAG_LDU_RANDOMIZER 0x10
+/* Save the secret key to `dir`/state and mark each layer once it is on disk,
+ * saving the key again with its random state past the layer's encodings, so
+ * that an interrupted run can be resumed.  A resumed CLT or GGHLite run draws
+ * its encodings on from there, so it never repeats the randomness of finished
+ * layers, but its output differs from that of an uninterrupted run */
+#define OBFUSCATOR_FLAG_CHECKPOINT 0x20
+/* Resume a checkpointed run in `dir`, skipping the layers it finished */
+#define OBFUSCATOR_FLAG_RESUME 0x40
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 typedef struct obf_state_s obf_state_t;
+typedef struct obf_eval_s obf_eval_t;
+typedef struct obf_session_s obf_session_t;
+
+/* A branching program layer: the matrix for each value of input `inp` */
+typedef struct {
+    long inp;
+    fmpz_mat_t mats[2];
+} obf_bp_layer_t;
+
+/* Receives the result of obf_eval_async: as from obf_eval, -1 on error */
+typedef void (*obf_eval_callback_t)(int iszero, void *arg);
 
 enum mmap_e { MMAP_CLT, MMAP_GGHLITE, MMAP_DUMMY };
 
@@ -43,9 +67,102 @@ int
 obf_evaluate(enum mmap_e type, char *dir, uint64_t len, uint64_t *input,
              uint64_t bplen, uint64_t ncores, bool verbose);
 
+int
+obf_evaluate_batch(enum mmap_e type, char *dir, uint64_t ninputs,
+                   uint64_t len, uint64_t *inputs, uint64_t bplen,
+                   uint64_t ncores, bool verbose, int *results);
+
+/*
+ * Bounds the layers queued by obf_encode_layer but not yet written to at most
+ * maxlayers layers and maxbytes bytes of encodings (0 for no limit), making
+ * obf_encode_layer block until earlier layers have been written.
+ */
+void
+obf_set_budget(obf_state_t *s, uint64_t maxlayers, uint64_t maxbytes);
+
+/*
+ * Draws up front, in parallel, the Kilian randomizers used by layers start
+ * through end - 1 of a program of nlayers layers, where layer i has ncols[i]
+ * columns.  Those layers can then be passed to obf_encode_layer in any order
+ * and are randomized independently of one another.  A range short of the
+ * whole program, for separate processes sharing a seed and an output
+ * directory, is only allowed with the dummy mmap: every process would derive
+ * the same secret key, whose encoding randomness would then repeat across
+ * them.
+ */
+int
+obf_randomizer_chain(obf_state_t *s, uint64_t nlayers, const long *ncols,
+                     uint64_t start, uint64_t end);
+
 void
 obf_wait(obf_state_t *s);
 
+/*
+ * Removes the checkpoint state, which holds the secret key, and the layer
+ * markers of a finished run started with OBFUSCATOR_FLAG_CHECKPOINT.  Call
+ * after obf_wait.
+ */
+int
+obf_checkpoint_remove(obf_state_t *s);
+
+obf_eval_t *
+obf_eval_open(enum mmap_e type, const char *dir, uint64_t bplen,
+              uint64_t memcap, bool verbose);
+
+void
+obf_eval_set_nodecap(obf_eval_t *h, uint64_t nodecap);
+
+void
+obf_eval_close(obf_eval_t *h);
+
+int
+obf_eval(obf_eval_t *h, uint64_t len, uint64_t *input, uint64_t ncores);
+
+int
+obf_eval_batch(obf_eval_t *h, uint64_t ninputs, uint64_t len,
+               uint64_t *inputs, uint64_t ncores, int *results);
+
+int
+obf_eval_set_nthreads(obf_eval_t *h, uint64_t nthreads);
+
+int
+obf_eval_async(obf_eval_t *h, uint64_t len, const uint64_t *input,
+               uint64_t ncores, obf_eval_callback_t callback, void *arg);
+
+void
+obf_eval_wait(obf_eval_t *h);
+
+obf_session_t *
+obf_session_open(obf_eval_t *h, uint64_t len, const uint64_t *input,
+                 uint64_t ncores);
+
+int
+obf_session_set(obf_session_t *s, uint64_t nchanges,
+                const uint64_t *positions, const uint64_t *values);
+
+int
+obf_session_result(const obf_session_t *s);
+
+void
+obf_session_close(obf_session_t *s);
+
+int
+obf_container_info(const char *fname, uint64_t *nslots, uint64_t *nlayers);
+
+/*
+ * Compiles the Boolean formula in the .circ file `fname` into the branching
+ * program pyobf/sz_bp.py builds for it, returning its *nlayers layers, to be
+ * freed with obf_bp_clear, or NULL if the file does not parse.  The reason,
+ * naming the offending line, is then left in the errlen bytes at err, or
+ * printed to stderr if err is NULL.
+ */
+obf_bp_layer_t *
+obf_sz_compile(const char *fname, uint64_t *nlayers, char *err,
+               size_t errlen);
+
+void
+obf_bp_clear(obf_bp_layer_t *layers, uint64_t nlayers);
+
 #ifdef __cplusplus
 }
 #endif
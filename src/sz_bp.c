@@ -0,0 +1,449 @@
+#include "obfuscator.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compiles Boolean formulas into branching programs as pyobf/sz_bp.py does.
+ * A two-input gate appends the reversed, transposed and augmented program of
+ * its second input to that of its first.  Rather than touch every layer of
+ * the second program each time, reversal, transposition and augmentation are
+ * kept as tags on the program, and on each layer relative to its program's
+ * tags; since transposing and augmenting commute, a layer's matrices are only
+ * worked out when a gate multiplies into them or at the end.  Programs are
+ * joined by moving the layers of the shorter one.
+ */
+
+struct sz_layer_s {
+    long inp;
+    fmpz_mat_t mats[2];
+    bool transposed;
+    long augment;
+};
+
+struct sz_bp_s {
+    struct sz_layer_s **buf;    /* layers in buf[head, head + len) */
+    size_t cap;
+    size_t head;
+    size_t len;
+    bool reversed;
+    bool transposed;
+    long augment;
+};
+
+static struct sz_layer_s **
+sz_at(struct sz_bp_s *bp, size_t i)
+{
+    return &bp->buf[bp->head + (bp->reversed ? bp->len - 1 - i : i)];
+}
+
+/* Makes room for `front` more layers before buf[head] and `back` after */
+static void
+sz_reserve(struct sz_bp_s *bp, size_t front, size_t back)
+{
+    struct sz_layer_s **buf;
+    size_t cap, head;
+
+    if (bp->head >= front && bp->head + bp->len + back <= bp->cap)
+        return;
+    cap = 2 * (bp->len + front + back);
+    head = front + (cap - bp->len - front - back) / 2;
+    buf = calloc(cap, sizeof(struct sz_layer_s *));
+    if (bp->len)
+        memcpy(buf + head, bp->buf + bp->head,
+               bp->len * sizeof(struct sz_layer_s *));
+    free(bp->buf);
+    bp->buf = buf;
+    bp->cap = cap;
+    bp->head = head;
+}
+
+/* Adds a layer, with its tags relative to bp's, at the end of bp */
+static void
+sz_push_back(struct sz_bp_s *bp, struct sz_layer_s *layer)
+{
+    if (bp->reversed) {
+        sz_reserve(bp, 1, 0);
+        bp->buf[--bp->head] = layer;
+    } else {
+        sz_reserve(bp, 0, 1);
+        bp->buf[bp->head + bp->len] = layer;
+    }
+    bp->len++;
+}
+
+/* Adds a layer, with its tags relative to bp's, at the start of bp */
+static void
+sz_push_front(struct sz_bp_s *bp, struct sz_layer_s *layer)
+{
+    if (bp->reversed) {
+        sz_reserve(bp, 0, 1);
+        bp->buf[bp->head + bp->len] = layer;
+    } else {
+        sz_reserve(bp, 1, 0);
+        bp->buf[--bp->head] = layer;
+    }
+    bp->len++;
+}
+
+/* Applies the pending tags of a layer of bp to its matrices */
+static void
+sz_materialize(struct sz_bp_s *bp, struct sz_layer_s *layer)
+{
+    const bool transposed = layer->transposed ^ bp->transposed;
+    const long augment = layer->augment + bp->augment;
+
+    for (int b = 0; b < 2; ++b) {
+        fmpz_mat_struct *m = layer->mats[b];
+        if (transposed) {
+            fmpz_mat_t t;
+            fmpz_mat_init(t, m->c, m->r);
+            fmpz_mat_transpose(t, m);
+            fmpz_mat_swap(m, t);
+            fmpz_mat_clear(t);
+        }
+        if (augment > 0) {
+            fmpz_mat_t t;
+            fmpz_mat_init(t, m->r + augment, m->c + augment);
+            for (long i = 0; i < m->r; ++i) {
+                for (long j = 0; j < m->c; ++j) {
+                    fmpz_set(fmpz_mat_entry(t, i, j),
+                             fmpz_mat_entry(m, i, j));
+                }
+            }
+            for (long i = 0; i < augment; ++i) {
+                fmpz_one(fmpz_mat_entry(t, m->r + i, m->c + i));
+            }
+            fmpz_mat_swap(m, t);
+            fmpz_mat_clear(t);
+        }
+    }
+    layer->transposed = bp->transposed;
+    layer->augment = -bp->augment;
+}
+
+static void
+sz_mult_left(struct sz_bp_s *bp, const fmpz_mat_t left)
+{
+    struct sz_layer_s *layer = *sz_at(bp, 0);
+
+    sz_materialize(bp, layer);
+    for (int b = 0; b < 2; ++b) {
+        fmpz_mat_t t;
+        fmpz_mat_init(t, left->r, layer->mats[b]->c);
+        fmpz_mat_mul(t, left, layer->mats[b]);
+        fmpz_mat_swap(layer->mats[b], t);
+        fmpz_mat_clear(t);
+    }
+}
+
+static void
+sz_mult_right(struct sz_bp_s *bp, const fmpz_mat_t right)
+{
+    struct sz_layer_s *layer = *sz_at(bp, bp->len - 1);
+
+    sz_materialize(bp, layer);
+    for (int b = 0; b < 2; ++b) {
+        fmpz_mat_t t;
+        fmpz_mat_init(t, layer->mats[b]->r, right->c);
+        fmpz_mat_mul(t, layer->mats[b], right);
+        fmpz_mat_swap(layer->mats[b], t);
+        fmpz_mat_clear(t);
+    }
+}
+
+static void
+sz_layer_free(struct sz_layer_s *layer)
+{
+    fmpz_mat_clear(layer->mats[0]);
+    fmpz_mat_clear(layer->mats[1]);
+    free(layer);
+}
+
+static void
+sz_bp_free(struct sz_bp_s *bp)
+{
+    if (bp == NULL)
+        return;
+    for (size_t i = 0; i < bp->len; ++i) {
+        sz_layer_free(bp->buf[bp->head + i]);
+    }
+    free(bp->buf);
+    free(bp);
+}
+
+/* Moves a layer of `from` into `to`, keeping what it stands for */
+static struct sz_layer_s *
+sz_retag(struct sz_layer_s *layer, const struct sz_bp_s *from,
+         const struct sz_bp_s *to)
+{
+    layer->transposed ^= from->transposed ^ to->transposed;
+    layer->augment += from->augment - to->augment;
+    return layer;
+}
+
+/* Returns the program running bp0 then bp1, freeing whichever is emptied */
+static struct sz_bp_s *
+sz_concat(struct sz_bp_s *bp0, struct sz_bp_s *bp1)
+{
+    if (bp0->len >= bp1->len) {
+        for (size_t i = 0; i < bp1->len; ++i) {
+            sz_push_back(bp0, sz_retag(*sz_at(bp1, i), bp1, bp0));
+        }
+        bp1->len = 0;
+        sz_bp_free(bp1);
+        return bp0;
+    } else {
+        for (size_t i = bp0->len; i-- > 0;) {
+            sz_push_front(bp1, sz_retag(*sz_at(bp0, i), bp0, bp1));
+        }
+        bp0->len = 0;
+        sz_bp_free(bp0);
+        return bp1;
+    }
+}
+
+static void
+sz_mat_init_set_si(fmpz_mat_t m, long nrows, long ncols, const long *entries)
+{
+    fmpz_mat_init(m, nrows, ncols);
+    for (long i = 0; i < nrows; ++i) {
+        for (long j = 0; j < ncols; ++j) {
+            fmpz_set_si(fmpz_mat_entry(m, i, j), entries[i * ncols + j]);
+        }
+    }
+}
+
+static struct sz_bp_s *
+sz_input_gate(long num)
+{
+    static const long zero[] = { 1, 0 }, one[] = { 1, 1 };
+    struct sz_bp_s *bp;
+    struct sz_layer_s *layer;
+
+    layer = calloc(1, sizeof(struct sz_layer_s));
+    layer->inp = num;
+    sz_mat_init_set_si(layer->mats[0], 1, 2, zero);
+    sz_mat_init_set_si(layer->mats[1], 1, 2, one);
+    bp = calloc(1, sizeof(struct sz_bp_s));
+    sz_push_back(bp, layer);
+    return bp;
+}
+
+static struct sz_bp_s *
+sz_two_input_gate(struct sz_bp_s *bp0, struct sz_bp_s *bp1, const long *left)
+{
+    static const long right[] = { 0, 1, 1, 0 };
+    fmpz_mat_t l, r;
+
+    bp1->reversed = !bp1->reversed;
+    bp1->transposed = !bp1->transposed;
+    bp1->augment++;
+    sz_mat_init_set_si(l, 2, 3, left);
+    sz_mat_init_set_si(r, 2, 2, right);
+    sz_mult_left(bp1, l);
+    sz_mult_right(bp1, r);
+    fmpz_mat_clear(l);
+    fmpz_mat_clear(r);
+    return sz_concat(bp0, bp1);
+}
+
+static struct sz_bp_s *
+sz_gate(const char *gate, struct sz_bp_s **in, int nin, int *nargs)
+{
+    static const long and_left[] = { 0, 0, 1, 0, 1, 0 };
+    static const long or_left[] = { 0, 1, 1, 1, -1, 0 };
+    static const long xor_left[] = { 0, 1, 1, 1, -2, 0 };
+    static const long not_right[] = { 1, 1, 0, -1 };
+    const long *left = NULL;
+
+    if (strcmp(gate, "AND") == 0)
+        left = and_left;
+    else if (strcmp(gate, "OR") == 0)
+        left = or_left;
+    else if (strcmp(gate, "XOR") == 0)
+        left = xor_left;
+    else if (strcmp(gate, "ID") != 0 && strcmp(gate, "NOT") != 0)
+        return NULL;
+
+    *nargs = left ? 2 : 1;
+    if (nin != *nargs)
+        return NULL;
+    if (left)
+        return sz_two_input_gate(in[0], in[1], left);
+    if (strcmp(gate, "NOT") == 0) {
+        fmpz_mat_t r;
+        sz_mat_init_set_si(r, 2, 2, not_right);
+        sz_mult_right(in[0], r);
+        fmpz_mat_clear(r);
+    }
+    return in[0];
+}
+
+/* Parses a whole-token integer */
+static int
+sz_parse_long(const char *s, long *x)
+{
+    char *end;
+
+    *x = strtol(s, &end, 10);
+    return (*s == '\0' || *end != '\0') ? OBFUSCATOR_ERR : OBFUSCATOR_OK;
+}
+
+/* Reports an error into err, or to stderr if err is NULL */
+static void
+sz_error(char *err, size_t errlen, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (err) {
+        (void) vsnprintf(err, errlen, fmt, ap);
+    } else {
+        (void) vfprintf(stderr, fmt, ap);
+        (void) fputc('\n', stderr);
+    }
+    va_end(ap);
+}
+
+obf_bp_layer_t *
+obf_sz_compile(const char *fname, uint64_t *nlayers, char *err, size_t errlen)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t linecap = 0;
+    struct sz_bp_s **gates = NULL, *out;
+    bool *used = NULL;
+    size_t ngates = 0, cap = 0;
+    obf_bp_layer_t *layers = NULL;
+    int lineno = 0;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        sz_error(err, errlen, "unable to open '%s'", fname);
+        return NULL;
+    }
+
+    while (getline(&line, &linecap, fp) != -1) {
+        const char *delim = " \t\r\n\v\f";
+        char *save, *tok, *gate;
+        struct sz_bp_s *in[2], *bp;
+        long num, wires[3];
+        int nin = 0, nargs = 0;
+
+        lineno++;
+        if (line[0] == '#' || line[0] == ':')
+            continue;
+        if ((tok = strtok_r(line, delim, &save)) == NULL
+            || (gate = strtok_r(NULL, delim, &save)) == NULL) {
+            sz_error(err, errlen, "Line %d: unable to parse line", lineno);
+            goto cleanup;
+        }
+        if (sz_parse_long(tok, &num) == OBFUSCATOR_ERR) {
+            sz_error(err, errlen, "Line %d: gate index not a number",
+                     lineno);
+            goto cleanup;
+        }
+
+        if (strncmp(gate, "input", 5) == 0) {
+            bp = sz_input_gate(num);
+        } else if (strncmp(gate, "gate", 4) == 0
+                   || strncmp(gate, "output", 6) == 0) {
+            if ((gate = strtok_r(NULL, delim, &save)) == NULL) {
+                sz_error(err, errlen, "Line %d: unable to parse line",
+                         lineno);
+                goto cleanup;
+            }
+            while ((tok = strtok_r(NULL, delim, &save)) != NULL) {
+                long w;
+                if (sz_parse_long(tok, &w) == OBFUSCATOR_ERR) {
+                    sz_error(err, errlen, "Line %d: input not a number",
+                             lineno);
+                    goto cleanup;
+                }
+                if (w < 0 || (size_t) w >= ngates) {
+                    sz_error(err, errlen, "Line %d: unknown input %ld",
+                             lineno, w);
+                    goto cleanup;
+                }
+                if (used[w] || (nin > 0 && wires[0] == w)
+                    || (nin > 1 && wires[1] == w)) {
+                    sz_error(err, errlen,
+                             "Line %d: only Boolean formulas supported",
+                             lineno);
+                    goto cleanup;
+                }
+                if (nin < 3)
+                    wires[nin] = w;
+                nin++;
+            }
+            for (int i = 0; i < nin && i < 2; ++i) {
+                in[i] = gates[wires[i]];
+            }
+            if ((bp = sz_gate(gate, in, nin, &nargs)) == NULL) {
+                if (nargs == 0)
+                    sz_error(err, errlen, "Line %d: unsupported gate %s",
+                             lineno, gate);
+                else
+                    sz_error(err, errlen,
+                             "Line %d: incorrect number of arguments given",
+                             lineno);
+                goto cleanup;
+            }
+            for (int i = 0; i < nin; ++i) {
+                gates[wires[i]] = NULL;
+                used[wires[i]] = true;
+            }
+        } else {
+            continue;
+        }
+
+        if (ngates == cap) {
+            cap = cap ? 2 * cap : 64;
+            gates = realloc(gates, cap * sizeof(struct sz_bp_s *));
+            used = realloc(used, cap * sizeof(bool));
+        }
+        gates[ngates] = bp;
+        used[ngates] = false;
+        ngates++;
+    }
+
+    if (ngates == 0) {
+        sz_error(err, errlen, "no gates found in '%s'", fname);
+        goto cleanup;
+    }
+
+    out = gates[ngates - 1];
+    *nlayers = out->len;
+    layers = calloc(out->len, sizeof(obf_bp_layer_t));
+    for (size_t i = 0; i < out->len; ++i) {
+        struct sz_layer_s *layer = *sz_at(out, i);
+        sz_materialize(out, layer);
+        layers[i].inp = layer->inp;
+        for (int b = 0; b < 2; ++b) {
+            fmpz_mat_init(layers[i].mats[b], 0, 0);
+            fmpz_mat_swap(layers[i].mats[b], layer->mats[b]);
+        }
+    }
+
+cleanup:
+    for (size_t i = 0; i < ngates; ++i) {
+        sz_bp_free(gates[i]);
+    }
+    free(gates);
+    free(used);
+    free(line);
+    fclose(fp);
+    return layers;
+}
+
+void
+obf_bp_clear(obf_bp_layer_t *layers, uint64_t nlayers)
+{
+    for (uint64_t i = 0; i < nlayers; ++i) {
+        fmpz_mat_clear(layers[i].mats[0]);
+        fmpz_mat_clear(layers[i].mats[1]);
+    }
+    free(layers);
+}
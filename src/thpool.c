@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <time.h> 
 #if defined(__linux__)
@@ -27,37 +28,37 @@
 #define THPOOL_DEBUG 0
 #endif
 
-static volatile int threads_keepalive;
 static volatile int threads_on_hold;
 
 
 /* ========================== STRUCTURES ============================ */
 
 
-/* Binary semaphore */
-typedef struct bsem {
-	pthread_mutex_t mutex;
-	pthread_cond_t   cond;
-	int v;
-} bsem;
-
-
 /* Job */
 typedef struct job {
 	struct job*  prev;                   /* pointer to previous job   */
 	void*  (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
-    char *tag;
+	struct group* group;                 /* completion group, or NULL */
+	long   priority;                     /* lower values run first    */
 } job;
 
 
-/* Job queue */
+/* Job queue
+ *
+ * Each worker owns one queue and takes jobs from it first; once it is empty
+ * the worker steals from the other queues in turn.  Jobs added from outside
+ * the pool are spread over the queues round-robin, and jobs added by a job
+ * go to its worker's own queue.  Every queue has its own lock, so workers only
+ * contend when they steal.  Queues are kept ordered by job priority, and jobs
+ * of equal priority run in the order they were added.
+ */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
-	bsem *has_jobs;                      /* flag as binary semaphore  */
-	int   len;                           /* number of jobs in queue   */
+	atomic_int len;                      /* number of jobs in queue,
+	                                        peeked at without the lock */
 } jobqueue;
 
 
@@ -68,34 +69,55 @@ typedef struct thread{
 	struct thpool_* thpool_p;            /* access to thpool          */
 } thread;
 
-typedef struct tag {
-    char *name;
-    int len;
-    void * (*function)(void *arg);
-    void *arg;
-} tag_t;
-
-typedef struct taglist_ {
-    int num;
-    pthread_mutex_t lock;
-    tag_t *tags;
-} taglist_t;
-
-// XXX: We don't clear the tag list, so if we have more than 1024 tags all hell
-// breaks loose!
-#define TAGLIST_SIZE 1024
+/* Completion group
+ *
+ * Counts down the jobs added to it; the job that brings the count to zero
+ * runs the continuation and then queues the jobs waiting on the group.
+ * Groups live in fixed-size chunks that never move, so jobs hold a pointer to
+ * their group and never touch the table.
+ */
+typedef struct group {
+	atomic_int remaining;                /* jobs not yet finished     */
+	void*  (*function)(void* arg);       /* continuation, or NULL     */
+	void*  arg;                          /* continuation's argument   */
+	long   priority;                     /* priority of the group's jobs */
+	_Atomic(struct job*) waiting;        /* jobs added after the group,
+	                                        GROUP_DONE once completed */
+} group;
+
+#define GROUP_DONE ((struct job*) &group_done_marker)
+static char group_done_marker;
+
+#define GROUP_CHUNK_SIZE 256
+
+typedef struct grouptable {
+	pthread_mutex_t lock;                /* guards growth and lookups */
+	group** chunks;                      /* GROUP_CHUNK_SIZE each     */
+	int num_chunks;                      /* capacity of chunks        */
+	int num_groups;                      /* handles handed out        */
+} grouptable;
 
 /* Threadpool */
 typedef struct thpool_{
 	thread**   threads;                  /* pointer to threads        */
 	volatile int num_threads_alive;      /* threads currently alive   */
-	volatile int num_threads_working;    /* threads currently working */
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
-	jobqueue*  jobqueue_p;               /* pointer to the job queue  */
-    taglist_t* tlist;
+	jobqueue*  jobqueues;                /* one job queue per worker  */
+	int        num_queues;
+	atomic_uint next_queue;              /* round-robin push target   */
+	atomic_int num_jobs_queued;          /* jobs not yet taken        */
+	atomic_int num_jobs_unfinished;      /* jobs queued or running    */
+	atomic_int num_threads_sleeping;     /* workers waiting for jobs  */
+	pthread_mutex_t  sleep_lock;
+	pthread_cond_t   has_jobs;           /* signal to sleeping threads */
+	atomic_int keepalive;                /* cleared by thpool_destroy */
+	grouptable groups;                   /* completion groups         */
 } thpool_;
 
+/* Worker thread the caller is running on, if any */
+static _Thread_local struct thread *current_thread;
+
 
 /* ========================== PROTOTYPES ============================ */
 
@@ -106,16 +128,17 @@ static void  thread_hold(int num);
 static void  thread_destroy(struct thread* thread_p);
 
 static int   jobqueue_init(thpool_* thpool_p);
-static void  jobqueue_clear(thpool_* thpool_p);
-static void  jobqueue_push(thpool_* thpool_p, struct job* newjob_p);
-static struct job* jobqueue_pull(thpool_* thpool_p);
+static void  jobqueue_clear(jobqueue* jobqueue_p);
+static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
+static struct job* jobqueue_pull(jobqueue* jobqueue_p);
+static struct job* jobqueue_take(thpool_* thpool_p, int id);
 static void  jobqueue_destroy(thpool_* thpool_p);
 
-static void  bsem_init(struct bsem *bsem_p, int value);
-static void  bsem_reset(struct bsem *bsem_p);
-static void  bsem_post(struct bsem *bsem_p);
-static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static void  thpool_push(thpool_* thpool_p, struct job* job_p);
+
+static struct group* group_get(thpool_* thpool_p, int handle);
+static int   group_defer(struct group* group_p, struct job* job_p);
+static void  group_done(thpool_* thpool_p, struct group* group_p, int count);
 
 
 /* ========================== THREADPOOL ============================ */
@@ -124,13 +147,21 @@ static void  bsem_wait(struct bsem *bsem_p);
 /* Initialise thread pool */
 struct thpool_*
 thpool_init(int num_threads)
+{
+	return thpool_init_queues(num_threads, num_threads);
+}
+
+struct thpool_*
+thpool_init_queues(int num_threads, int num_queues)
 {
 	threads_on_hold   = 0;
-	threads_keepalive = 1;
 
 	if (num_threads < 0){
 		num_threads = 0;
 	}
+	if (num_queues < 1){
+		num_queues = 1;
+	}
 
 	/* Make new thread pool */
 	thpool_* thpool_p;
@@ -140,7 +171,12 @@ thpool_init(int num_threads)
 		return NULL;
 	}
 	thpool_p->num_threads_alive   = 0;
-	thpool_p->num_threads_working = 0;
+	thpool_p->num_queues          = num_queues;
+	atomic_init(&thpool_p->next_queue, 0);
+	atomic_init(&thpool_p->num_jobs_queued, 0);
+	atomic_init(&thpool_p->num_jobs_unfinished, 0);
+	atomic_init(&thpool_p->num_threads_sleeping, 0);
+	atomic_init(&thpool_p->keepalive, 1);
 
 	/* Initialise the job queue */
 	if (jobqueue_init(thpool_p) == -1) {
@@ -154,38 +190,20 @@ thpool_init(int num_threads)
 	if (thpool_p->threads == NULL){
 		fprintf(stderr, "thpool_init(): Could not allocate memory for threads\n");
 		jobqueue_destroy(thpool_p);
-		free(thpool_p->jobqueue_p);
 		free(thpool_p);
 		return NULL;
 	}
 
-    /* Make tag list */
-    taglist_t *tlist;
-    tlist = (taglist_t *) malloc(sizeof(taglist_t));
-    if (tlist == NULL) {
-        fprintf(stderr, "thpool_init(): Could not allocate memory for job queue\n");
-		jobqueue_destroy(thpool_p);
-		free(thpool_p->jobqueue_p);
-        free(thpool_p->threads);
-		free(thpool_p);
-        return NULL;
-    }
-    tlist->num = TAGLIST_SIZE;
-    tlist->tags = (tag_t *) calloc(tlist->num, sizeof(tag_t));
-    if (tlist->tags == NULL) {
-        fprintf(stderr, "thpool_init(): Could not allocate memory for tag list\n");
-		jobqueue_destroy(thpool_p);
-		free(thpool_p->jobqueue_p);
-        free(thpool_p->threads);
-		free(thpool_p);
-        free(tlist);
-        return NULL;
-    }
-    pthread_mutex_init(&tlist->lock, NULL);
-    thpool_p->tlist = tlist;
+	/* Completion groups are allocated as they are added */
+	thpool_p->groups.chunks = NULL;
+	thpool_p->groups.num_chunks = 0;
+	thpool_p->groups.num_groups = 0;
+	pthread_mutex_init(&thpool_p->groups.lock, NULL);
 
 	pthread_mutex_init(&(thpool_p->thcount_lock), NULL);
 	pthread_cond_init(&thpool_p->threads_all_idle, NULL);
+	pthread_mutex_init(&(thpool_p->sleep_lock), NULL);
+	pthread_cond_init(&thpool_p->has_jobs, NULL);
 	
 	/* Thread init */
 	for (int n = 0; n < num_threads; n++) {
@@ -200,56 +218,81 @@ thpool_init(int num_threads)
 	return thpool_p;
 }
 
+/* Add a completion group, returning its handle */
 int
-thpool_add_tag(thpool_ *thpool_p, char *tag, int length,
-               void * (fn)(void *arg), void *arg)
+thpool_add_group(thpool_* thpool_p, int length, long priority,
+                 void *(*function_p)(void*), void* arg_p)
 {
-    for (int i = 0; i < thpool_p->tlist->num; ++i) {
-        struct tag *t = &thpool_p->tlist->tags[i];
-        if (t->name == NULL) {
-            t->name = (char *) calloc(strlen(tag) + 1, sizeof(char));
-            (void) strcpy(t->name, tag);
-            t->len = length;
-            t->function = fn;
-            t->arg = arg;
-            return 0;
-        } else if (strcmp(tag, t->name) == 0) {
-            fprintf(stderr, "thpool_add_tag(): tag '%s' already in tag list\n", tag);
-            return -1;
-        }
-    }
-
-    fprintf(stderr, "thpool_add_tag(): tag list full!\n");
-    return -1;
-}
+	grouptable* table = &thpool_p->groups;
+	group* group_p;
+	int handle;
 
+	if (length < 1) {
+		fprintf(stderr, "thpool_add_group(): group must have at least one job\n");
+		return -1;
+	}
 
-static int
-tag_decrement(thpool_ *thpool_p, char *tag)
-{
-    for (int i = 0; i < thpool_p->tlist->num; ++i) {
-        struct tag *t = &thpool_p->tlist->tags[i];
-        if (strcmp(t->name, tag) == 0) {
-            pthread_mutex_lock(&thpool_p->tlist->lock);
-            t->len--;
-            pthread_mutex_unlock(&thpool_p->tlist->lock);
-            if (t->len == 0) {
-                t->function(t->arg);
-            }
-            return 0;
-        }
-    }
-    fprintf(stderr, "tag_decrement(): tag does not exist in tag list\n");
-    return -1;
+	pthread_mutex_lock(&table->lock);
+	handle = table->num_groups;
+	if (handle % GROUP_CHUNK_SIZE == 0) {
+		int c = handle / GROUP_CHUNK_SIZE;
+		if (c == table->num_chunks) {
+			int num = table->num_chunks ? 2 * table->num_chunks : 16;
+			group** chunks = (group**) realloc(table->chunks,
+			                                   num * sizeof(group *));
+			if (chunks == NULL) {
+				pthread_mutex_unlock(&table->lock);
+				fprintf(stderr, "thpool_add_group(): Could not allocate memory for group table\n");
+				return -1;
+			}
+			table->chunks = chunks;
+			table->num_chunks = num;
+		}
+		table->chunks[c] = (group*) calloc(GROUP_CHUNK_SIZE, sizeof(group));
+		if (table->chunks[c] == NULL) {
+			pthread_mutex_unlock(&table->lock);
+			fprintf(stderr, "thpool_add_group(): Could not allocate memory for group\n");
+			return -1;
+		}
+	}
+	group_p = &table->chunks[handle / GROUP_CHUNK_SIZE][handle % GROUP_CHUNK_SIZE];
+	atomic_init(&group_p->remaining, length);
+	atomic_init(&group_p->waiting, NULL);
+	group_p->function = function_p;
+	group_p->arg = arg_p;
+	group_p->priority = priority;
+	table->num_groups++;
+	pthread_mutex_unlock(&table->lock);
+
+	return handle;
 }
 
 
 /* Add work to the thread pool */
 int
 thpool_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p,
-                char *tag)
+                int handle)
+{
+	return thpool_add_work_after(thpool_p, function_p, arg_p, handle, -1);
+}
+
+
+/* Add work to the thread pool, to be queued once group `after` completes */
+int
+thpool_add_work_after(thpool_* thpool_p, void *(*function_p)(void*),
+                      void* arg_p, int handle, int after)
 {
 	job *newjob;
+	struct group *group_p = NULL, *after_p = NULL;
+
+	if (handle >= 0 && (group_p = group_get(thpool_p, handle)) == NULL) {
+		fprintf(stderr, "thpool_add_work(): group %d does not exist\n", handle);
+		return -1;
+	}
+	if (after >= 0 && (after_p = group_get(thpool_p, after)) == NULL) {
+		fprintf(stderr, "thpool_add_work(): group %d does not exist\n", after);
+		return -1;
+	}
 
 	newjob = (struct job*) malloc(sizeof(struct job));
 	if (newjob == NULL) {
@@ -260,22 +303,59 @@ thpool_add_work(thpool_* thpool_p, void *(*function_p)(void*), void* arg_p,
 	/* add function and argument */
 	newjob->function = function_p;
 	newjob->arg = arg_p;
-    newjob->tag = (char *) calloc(strlen(tag) + 1, sizeof(char));
-    (void) strcpy(newjob->tag, tag);
+	newjob->group = group_p;
+	newjob->priority = group_p ? group_p->priority : 0;
 
-	/* add job to queue */
-	pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
-	jobqueue_push(thpool_p, newjob);
-	pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
+	atomic_fetch_add(&thpool_p->num_jobs_unfinished, 1);
+	if (after_p == NULL || !group_defer(after_p, newjob))
+		thpool_push(thpool_p, newjob);
 
 	return 0;
 }
 
 
+/* Count jobs of a group as finished without running them */
+int
+thpool_skip_work(thpool_* thpool_p, int handle, int count)
+{
+	struct group *group_p;
+
+	if ((group_p = group_get(thpool_p, handle)) == NULL) {
+		fprintf(stderr, "thpool_skip_work(): group %d does not exist\n", handle);
+		return -1;
+	}
+	if (count > 0)
+		group_done(thpool_p, group_p, count);
+	return 0;
+}
+
+
+/* Queue a job that is ready to run */
+static void
+thpool_push(thpool_* thpool_p, struct job* job_p)
+{
+	/* add job to the worker's own queue, or spread over the queues */
+	int q;
+	if (current_thread && current_thread->thpool_p == thpool_p)
+		q = current_thread->id % thpool_p->num_queues;
+	else
+		q = atomic_fetch_add(&thpool_p->next_queue, 1) % thpool_p->num_queues;
+	atomic_fetch_add(&thpool_p->num_jobs_queued, 1);
+	jobqueue_push(&thpool_p->jobqueues[q], job_p);
+
+	/* wake up a sleeping thread, if any */
+	if (atomic_load(&thpool_p->num_threads_sleeping) > 0) {
+		pthread_mutex_lock(&thpool_p->sleep_lock);
+		pthread_cond_signal(&thpool_p->has_jobs);
+		pthread_mutex_unlock(&thpool_p->sleep_lock);
+	}
+}
+
+
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p){
 	pthread_mutex_lock(&thpool_p->thcount_lock);
-	while (thpool_p->jobqueue_p->len || thpool_p->num_threads_working) {
+	while (atomic_load(&thpool_p->num_jobs_unfinished)) {
 		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
 	}
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
@@ -290,34 +370,45 @@ void thpool_destroy(thpool_* thpool_p){
 	volatile int threads_total = thpool_p->num_threads_alive;
 
 	/* End each thread's infinite loop */
-	threads_keepalive = 0;
-	
-	/* Give one second to kill idle threads */
-	double TIMEOUT = 1.0;
-	time_t start, end;
-	double tpassed = 0.0;
-	time (&start);
-	while (tpassed < TIMEOUT && thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue_p->has_jobs);
-		time (&end);
-		tpassed = difftime(end,start);
-	}
-	
-	/* Poll remaining threads */
+	atomic_store(&thpool_p->keepalive, 0);
+	pthread_mutex_lock(&thpool_p->sleep_lock);
+	pthread_cond_broadcast(&thpool_p->has_jobs);
+	pthread_mutex_unlock(&thpool_p->sleep_lock);
+
+	/* Wait for the threads to exit */
+	pthread_mutex_lock(&thpool_p->thcount_lock);
 	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue_p->has_jobs);
-		sleep(1);
+		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
 	}
+	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
 	/* Job queue cleanup */
 	jobqueue_destroy(thpool_p);
-	free(thpool_p->jobqueue_p);
-	
+
+	/* Completion group cleanup, freeing jobs held back by unfinished groups */
+	for (int g = 0; g < thpool_p->groups.num_groups; g++) {
+		group* group_p = group_get(thpool_p, g);
+		job* job_p = atomic_load(&group_p->waiting);
+		while (job_p != NULL && job_p != GROUP_DONE) {
+			job* prev_p = job_p->prev;
+			free(job_p->arg);
+			free(job_p);
+			job_p = prev_p;
+		}
+	}
+	for (int c = 0; c * GROUP_CHUNK_SIZE < thpool_p->groups.num_groups; c++) {
+		free(thpool_p->groups.chunks[c]);
+	}
+	free(thpool_p->groups.chunks);
+	pthread_mutex_destroy(&thpool_p->groups.lock);
+
 	/* Deallocs */
 	int n;
 	for (n=0; n < threads_total; n++){
 		thread_destroy(thpool_p->threads[n]);
 	}
+	pthread_mutex_destroy(&thpool_p->sleep_lock);
+	pthread_cond_destroy(&thpool_p->has_jobs);
 	free(thpool_p->threads);
 	free(thpool_p);
 }
@@ -415,44 +506,46 @@ thread_do(void* varg)
 	}
 	
 	/* Mark thread as alive (initialized) */
+	current_thread = thread_p;
 	pthread_mutex_lock(&thpool_p->thcount_lock);
 	thpool_p->num_threads_alive += 1;
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
-	while (threads_keepalive) {
-
-		bsem_wait(thpool_p->jobqueue_p->has_jobs);
+	while (atomic_load(&thpool_p->keepalive)) {
+
+		job* job_p;
+
+		/* Take a job from our own queue, or steal one */
+		job_p = jobqueue_take(thpool_p, thread_p->id);
+		if (job_p == NULL) {
+			/* Sleep until a job is added.  Whoever adds one checks
+			 * num_threads_sleeping after bumping num_jobs_queued, so
+			 * either we see the job or they see us. */
+			pthread_mutex_lock(&thpool_p->sleep_lock);
+			atomic_fetch_add(&thpool_p->num_threads_sleeping, 1);
+			while (atomic_load(&thpool_p->num_jobs_queued) == 0
+			       && atomic_load(&thpool_p->keepalive)) {
+				pthread_cond_wait(&thpool_p->has_jobs, &thpool_p->sleep_lock);
+			}
+			atomic_fetch_sub(&thpool_p->num_threads_sleeping, 1);
+			pthread_mutex_unlock(&thpool_p->sleep_lock);
+			continue;
+		}
 
-		if (threads_keepalive) {
+		job_p->function(job_p->arg);
+		if (job_p->group)
+			group_done(thpool_p, job_p->group, 1);
+		free(job_p);
 
-			job* job_p;
-			
+		if (atomic_fetch_sub(&thpool_p->num_jobs_unfinished, 1) == 1) {
 			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working++;
+			pthread_cond_broadcast(&thpool_p->threads_all_idle);
 			pthread_mutex_unlock(&thpool_p->thcount_lock);
-			
-			/* Read job from queue and execute it */
-			pthread_mutex_lock(&thpool_p->jobqueue_p->rwmutex);
-			job_p = jobqueue_pull(thpool_p);
-			pthread_mutex_unlock(&thpool_p->jobqueue_p->rwmutex);
-			if (job_p) {
-				job_p->function(job_p->arg);
-                tag_decrement(thpool_p, job_p->tag);
-                free(job_p->tag);
-				free(job_p);
-			}
-			
-			pthread_mutex_lock(&thpool_p->thcount_lock);
-			thpool_p->num_threads_working--;
-			if (!thpool_p->num_threads_working) {
-				pthread_cond_signal(&thpool_p->threads_all_idle);
-			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
-
 		}
 	}
 	pthread_mutex_lock(&thpool_p->thcount_lock);
 	thpool_p->num_threads_alive --;
+	pthread_cond_broadcast(&thpool_p->threads_all_idle);
 	pthread_mutex_unlock(&thpool_p->thcount_lock);
 
 	return NULL;
@@ -470,155 +563,186 @@ thread_destroy (thread* thread_p)
 /* ============================ JOB QUEUE =========================== */
 
 
-/* Initialize queue */
+/* Initialize queues */
 static int jobqueue_init(thpool_* thpool_p){
-	
-	thpool_p->jobqueue_p = (struct jobqueue*)malloc(sizeof(struct jobqueue));
-	if (thpool_p->jobqueue_p == NULL){
-		return -1;
-	}
-	thpool_p->jobqueue_p->len = 0;
-	thpool_p->jobqueue_p->front = NULL;
-	thpool_p->jobqueue_p->rear  = NULL;
 
-	thpool_p->jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (thpool_p->jobqueue_p->has_jobs == NULL){
+	thpool_p->jobqueues = (struct jobqueue*)calloc(thpool_p->num_queues,
+	                                               sizeof(struct jobqueue));
+	if (thpool_p->jobqueues == NULL){
 		return -1;
 	}
-
-	pthread_mutex_init(&(thpool_p->jobqueue_p->rwmutex), NULL);
-	bsem_init(thpool_p->jobqueue_p->has_jobs, 0);
+	for (int q = 0; q < thpool_p->num_queues; q++){
+		thpool_p->jobqueues[q].len = 0;
+		thpool_p->jobqueues[q].front = NULL;
+		thpool_p->jobqueues[q].rear  = NULL;
+		pthread_mutex_init(&(thpool_p->jobqueues[q].rwmutex), NULL);
+	}
 
 	return 0;
 }
 
 
-/* Clear the queue */
-static void jobqueue_clear(thpool_* thpool_p){
+/* Clear a queue, freeing the jobs left in it and their arguments */
+static void jobqueue_clear(jobqueue* jobqueue_p){
 
-	while(thpool_p->jobqueue_p->len){
-		free(jobqueue_pull(thpool_p));
+	job* job_p;
+	while ((job_p = jobqueue_pull(jobqueue_p)) != NULL){
+		free(job_p->arg);
+		free(job_p);
 	}
 
-	thpool_p->jobqueue_p->front = NULL;
-	thpool_p->jobqueue_p->rear  = NULL;
-	bsem_reset(thpool_p->jobqueue_p->has_jobs);
-	thpool_p->jobqueue_p->len = 0;
-
 }
 
 
-/* Add (allocated) job to queue
- *
- * Notice: Caller MUST hold a mutex
- */
-static void jobqueue_push(thpool_* thpool_p, struct job* newjob){
+/* Add (allocated) job to queue, behind the jobs of the same or lower
+ * priority.  Jobs mostly arrive in priority order, so this is usually an
+ * append. */
+static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
 
 	newjob->prev = NULL;
 
-	switch(thpool_p->jobqueue_p->len){
-
-		case 0:  /* if no jobs in queue */
-					thpool_p->jobqueue_p->front = newjob;
-					thpool_p->jobqueue_p->rear  = newjob;
-					break;
-
-		default: /* if jobs in queue */
-					thpool_p->jobqueue_p->rear->prev = newjob;
-					thpool_p->jobqueue_p->rear = newjob;
-					
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	if (jobqueue_p->len == 0) {
+		jobqueue_p->front = newjob;
+		jobqueue_p->rear  = newjob;
+	} else if (newjob->priority >= jobqueue_p->rear->priority) {
+		jobqueue_p->rear->prev = newjob;
+		jobqueue_p->rear = newjob;
+	} else if (newjob->priority < jobqueue_p->front->priority) {
+		newjob->prev = jobqueue_p->front;
+		jobqueue_p->front = newjob;
+	} else {
+		job* job_p = jobqueue_p->front;
+		while (job_p->prev->priority <= newjob->priority)
+			job_p = job_p->prev;
+		newjob->prev = job_p->prev;
+		job_p->prev = newjob;
 	}
-	thpool_p->jobqueue_p->len++;
-	
-	bsem_post(thpool_p->jobqueue_p->has_jobs);
+	jobqueue_p->len++;
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
 }
 
 
-/* Get first job from queue(removes it from queue)
- * 
- * Notice: Caller MUST hold a mutex
- */
+/* Get first job from queue (removes it from queue), or NULL if it is empty */
 static struct job *
-jobqueue_pull(thpool_ *thpool_p)
+jobqueue_pull(jobqueue *jobqueue_p)
 {
 	job *job_p;
-	job_p = thpool_p->jobqueue_p->front;
 
-	switch(thpool_p->jobqueue_p->len) {
-		
+	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	job_p = jobqueue_p->front;
+
+	switch(jobqueue_p->len) {
+
     case 0:  /* if no jobs in queue */
         break;
-		
+
     case 1:  /* if one job in queue */
-        thpool_p->jobqueue_p->front = NULL;
-        thpool_p->jobqueue_p->rear  = NULL;
-        thpool_p->jobqueue_p->len = 0;
+        jobqueue_p->front = NULL;
+        jobqueue_p->rear  = NULL;
+        jobqueue_p->len = 0;
         break;
-		
+
     default: /* if >1 jobs in queue */
-        thpool_p->jobqueue_p->front = job_p->prev;
-        thpool_p->jobqueue_p->len--;
-        /* more than one job in queue -> post it */
-        bsem_post(thpool_p->jobqueue_p->has_jobs);
-					
+        jobqueue_p->front = job_p->prev;
+        jobqueue_p->len--;
+
 	}
-	
+	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+
 	return job_p;
 }
 
 
-/* Free all queue resources back to the system */
-static void jobqueue_destroy(thpool_* thpool_p){
-	jobqueue_clear(thpool_p);
-	free(thpool_p->jobqueue_p->has_jobs);
+/* Take a job for worker `id`: from its own queue if possible, otherwise
+ * stolen from the next non-empty queue */
+static struct job *
+jobqueue_take(thpool_ *thpool_p, int id)
+{
+	job *job_p;
+	int own = id % thpool_p->num_queues;
+
+	for (int i = 0; i < thpool_p->num_queues; i++) {
+		jobqueue *jobqueue_p = &thpool_p->jobqueues[(own + i) % thpool_p->num_queues];
+		/* peek without the lock, so idle thieves do not contend */
+		if (i > 0 && atomic_load_explicit(&jobqueue_p->len,
+		                                  memory_order_relaxed) == 0)
+			continue;
+		if ((job_p = jobqueue_pull(jobqueue_p)) != NULL) {
+			atomic_fetch_sub(&thpool_p->num_jobs_queued, 1);
+			return job_p;
+		}
+	}
+	return NULL;
 }
 
 
-/* ======================== SYNCHRONISATION ========================= */
-
-
-/* Init semaphore to 1 or 0 */
-static void bsem_init(bsem *bsem_p, int value) {
-	if (value < 0 || value > 1) {
-		fprintf(stderr, "bsem_init(): Binary semaphore can take only values 1 or 0");
-		exit(1);
+/* Free all queue resources back to the system */
+static void jobqueue_destroy(thpool_* thpool_p){
+	for (int q = 0; q < thpool_p->num_queues; q++){
+		jobqueue_clear(&thpool_p->jobqueues[q]);
+		pthread_mutex_destroy(&thpool_p->jobqueues[q].rwmutex);
 	}
-	pthread_mutex_init(&(bsem_p->mutex), NULL);
-	pthread_cond_init(&(bsem_p->cond), NULL);
-	bsem_p->v = value;
+	free(thpool_p->jobqueues);
 }
 
 
-/* Reset semaphore to 0 */
-static void bsem_reset(bsem *bsem_p) {
-	bsem_init(bsem_p, 0);
-}
 
+/* ======================== COMPLETION GROUPS ======================= */
 
-/* Post to at least one thread */
-static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+
+/* Look up a group by handle */
+static struct group *
+group_get(thpool_* thpool_p, int handle)
+{
+	group* group_p = NULL;
+
+	pthread_mutex_lock(&thpool_p->groups.lock);
+	if (handle < thpool_p->groups.num_groups)
+		group_p = &thpool_p->groups.chunks[handle / GROUP_CHUNK_SIZE]
+		                                  [handle % GROUP_CHUNK_SIZE];
+	pthread_mutex_unlock(&thpool_p->groups.lock);
+	return group_p;
 }
 
 
-/* Post to all threads */
-static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	bsem_p->v = 1;
-	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+/* Hold a job back until the group completes, returning 0 if it already has */
+static int
+group_defer(struct group* group_p, struct job* job_p)
+{
+	job* head = atomic_load(&group_p->waiting);
+
+	do {
+		if (head == GROUP_DONE)
+			return 0;
+		job_p->prev = head;
+	} while (!atomic_compare_exchange_weak(&group_p->waiting, &head, job_p));
+	return 1;
 }
 
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+/* Mark `count` jobs of a group as finished.  After the last one, run the
+ * continuation and queue the waiting jobs in the order they were added */
+static void
+group_done(thpool_* thpool_p, struct group* group_p, int count)
+{
+	job *job_p, *prev_p, *next_p = NULL;
+
+	if (atomic_fetch_sub(&group_p->remaining, count) != count)
+		return;
+	if (group_p->function)
+		group_p->function(group_p->arg);
+
+	job_p = atomic_exchange(&group_p->waiting, GROUP_DONE);
+	while (job_p != NULL) {
+		prev_p = job_p->prev;
+		job_p->prev = next_p;
+		next_p = job_p;
+		job_p = prev_p;
+	}
+	while (next_p != NULL) {
+		job_p = next_p;
+		next_p = job_p->prev;
+		thpool_push(thpool_p, job_p);
 	}
-	bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
 }
@@ -37,9 +37,44 @@ typedef struct thpool_* threadpool;
 threadpool thpool_init(int num_threads);
 
 
-int
-thpool_add_tag(threadpool thpool_p, char *tag, int length,
-               void * (fn)(void *arg), void *arg);
+/**
+ * @brief  Initialize threadpool with a given number of job queues
+ *
+ * Like thpool_init(), which uses one queue per thread.  Each thread takes
+ * jobs from queue (id % num_queues) first and steals from the others when it
+ * runs dry; num_queues = 1 gives a single queue shared by all threads.
+ *
+ * @param  num_threads   number of threads to be created in the threadpool
+ * @param  num_queues    number of job queues
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_queues(int num_threads, int num_queues);
+
+
+/**
+ * @brief  Add a completion group
+ *
+ * A completion group counts down the jobs added to it with
+ * thpool_add_work().  Once `length` of them have finished, the thread that
+ * ran the last one calls function_p(arg_p) exactly once.  There is no limit
+ * on the number of groups.  Jobs added with thpool_add_work_after() are
+ * queued once the group and its continuation have completed, which lets
+ * callers build a graph of dependent jobs.
+ *
+ * Each queue runs the jobs of groups with lower priority values first; jobs
+ * without a group have priority 0.
+ *
+ * @param  threadpool    threadpool the group belongs to
+ * @param  length        number of jobs in the group, at least one
+ * @param  priority      priority of the group's jobs, lower runs first
+ * @param  function_p    continuation to run when the group completes, or NULL
+ * @param  arg_p         argument to the continuation
+ * @return handle        non-negative group handle on success,
+ *                       -1 on error
+ */
+int thpool_add_group(threadpool, int length, long priority,
+                     void *(*function_p)(void*), void* arg_p);
 
 
 /**
@@ -60,17 +95,53 @@ thpool_add_tag(threadpool thpool_p, char *tag, int length,
  *    int main() {
  *       ..
  *       int a = 10;
- *       thpool_add_work(thpool, (void*)print_num, (void*)a);
+ *       thpool_add_work(thpool, (void*)print_num, (void*)a, -1);
  *       ..
  *    }
  * 
  * @param  threadpool    threadpool to which the work will be added
  * @param  function_p    pointer to function to add as work
  * @param  arg_p         pointer to an argument
- * @return nothing
+ * @param  group         completion group handle, or -1 for none
+ * @return 0 on success, -1 otherwise
  */
 int thpool_add_work(threadpool, void *(*function_p)(void*), void* arg_p,
-                    char *tag);
+                    int group);
+
+
+/**
+ * @brief Add work to be queued once a completion group completes
+ *
+ * Like thpool_add_work(), but the job is held back until every job of the
+ * group `after` has finished and its continuation has returned.  If the
+ * group has already completed the job is queued immediately.  thpool_wait()
+ * counts held-back jobs as unfinished.
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  arg_p         pointer to an argument
+ * @param  group         completion group handle, or -1 for none
+ * @param  after         group to wait for, or -1 for none
+ * @return 0 on success, -1 otherwise
+ */
+int thpool_add_work_after(threadpool, void *(*function_p)(void*),
+                          void* arg_p, int group, int after);
+
+
+/**
+ * @brief Count jobs of a completion group as finished without running them
+ *
+ * For callers that added a group but could not add all of its jobs: the
+ * group completes once the jobs that were added have finished, and if they
+ * already have, its continuation runs in the calling thread before this
+ * returns.
+ *
+ * @param  threadpool    threadpool the group belongs to
+ * @param  group         completion group handle
+ * @param  count         number of jobs never to be added to the group
+ * @return 0 on success, -1 otherwise
+ */
+int thpool_skip_work(threadpool, int group, int count);
 
 
 /**
@@ -147,7 +218,9 @@ void thpool_resume(threadpool);
  * @brief Destroy the threadpool
  * 
  * This will wait for the currently active threads to finish and then 'kill'
- * the whole threadpool to free up memory.
+ * the whole threadpool to free up memory.  Jobs still queued or held back
+ * by unfinished groups are discarded without running, and their arguments
+ * are freed with free().
  * 
  * @example
  * int main() {
@@ -0,0 +1,424 @@
+/*
+ * Thread pool benchmark.
+ *
+ * Pushes many small jobs through a pool and reports throughput and the
+ * distribution of queueing latency (time from adding a job until it starts
+ * running).  Three pools are compared: the baseline pool that thpool.c
+ * replaced (reproduced below), the current pool with a single job queue
+ * shared by all threads, and the current pool with a queue per thread.  Jobs
+ * are either all added by the main thread, or fanned out by one spawner job
+ * per thread, as when jobs add further jobs.
+ *
+ * Usage: thpool_bench [nthreads] [njobs] [work_ns]
+ */
+
+#include "thpool.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The baseline: the job path of the pool before per-thread queues and
+ * completion groups.  All jobs go through one queue behind one mutex,
+ * workers are woken through a binary semaphore, a shared count of working
+ * threads is updated around every job, and completion is tracked by looking
+ * up each job's copy of a string tag.
+ */
+
+typedef struct legacy_job_s {
+    struct legacy_job_s *next;
+    void *(*function)(void *);
+    void *arg;
+    char *tag;
+} legacy_job_t;
+
+typedef struct {
+    pthread_t *threads;
+    int nthreads;
+    atomic_int keepalive;
+    pthread_mutex_t rwmutex;    /* guards the queue */
+    legacy_job_t *front;
+    legacy_job_t *rear;
+    int len;
+    pthread_mutex_t bsem_lock;  /* binary semaphore: jobs may be queued */
+    pthread_cond_t bsem_cond;
+    int bsem_v;
+    pthread_mutex_t thcount_lock;
+    pthread_cond_t all_idle;
+    int working;
+    pthread_mutex_t tag_lock;
+    char *tag;
+    int tag_len;
+    void *(*tag_fn)(void *);
+    void *tag_arg;
+} legacy_pool_t;
+
+static void
+legacy_bsem_post(legacy_pool_t *p, bool all)
+{
+    pthread_mutex_lock(&p->bsem_lock);
+    p->bsem_v = 1;
+    if (all)
+        pthread_cond_broadcast(&p->bsem_cond);
+    else
+        pthread_cond_signal(&p->bsem_cond);
+    pthread_mutex_unlock(&p->bsem_lock);
+}
+
+static void
+legacy_bsem_wait(legacy_pool_t *p)
+{
+    pthread_mutex_lock(&p->bsem_lock);
+    while (p->bsem_v != 1 && atomic_load(&p->keepalive))
+        pthread_cond_wait(&p->bsem_cond, &p->bsem_lock);
+    p->bsem_v = 0;
+    pthread_mutex_unlock(&p->bsem_lock);
+}
+
+static void
+legacy_tag_decrement(legacy_pool_t *p, const char *tag)
+{
+    bool done;
+
+    if (strcmp(tag, p->tag) != 0)
+        return;
+    pthread_mutex_lock(&p->tag_lock);
+    done = --p->tag_len == 0;
+    pthread_mutex_unlock(&p->tag_lock);
+    if (done)
+        p->tag_fn(p->tag_arg);
+}
+
+static void *
+legacy_thread(void *vargs)
+{
+    legacy_pool_t *p = (legacy_pool_t *) vargs;
+
+    while (atomic_load(&p->keepalive)) {
+        legacy_job_t *job;
+
+        legacy_bsem_wait(p);
+        if (!atomic_load(&p->keepalive))
+            break;
+
+        pthread_mutex_lock(&p->thcount_lock);
+        p->working++;
+        pthread_mutex_unlock(&p->thcount_lock);
+
+        pthread_mutex_lock(&p->rwmutex);
+        if ((job = p->front) != NULL) {
+            p->front = job->next;
+            if (--p->len == 0)
+                p->rear = NULL;
+            else
+                legacy_bsem_post(p, false);
+        }
+        pthread_mutex_unlock(&p->rwmutex);
+        if (job) {
+            job->function(job->arg);
+            legacy_tag_decrement(p, job->tag);
+            free(job->tag);
+            free(job);
+        }
+
+        pthread_mutex_lock(&p->thcount_lock);
+        if (--p->working == 0)
+            pthread_cond_signal(&p->all_idle);
+        pthread_mutex_unlock(&p->thcount_lock);
+    }
+    return NULL;
+}
+
+static void *
+legacy_init(int nthreads, int nqueues)
+{
+    legacy_pool_t *p = calloc(1, sizeof(legacy_pool_t));
+
+    (void) nqueues;
+    atomic_init(&p->keepalive, 1);
+    pthread_mutex_init(&p->rwmutex, NULL);
+    pthread_mutex_init(&p->bsem_lock, NULL);
+    pthread_cond_init(&p->bsem_cond, NULL);
+    pthread_mutex_init(&p->thcount_lock, NULL);
+    pthread_cond_init(&p->all_idle, NULL);
+    pthread_mutex_init(&p->tag_lock, NULL);
+    p->tag = strdup("bench");
+    p->nthreads = nthreads;
+    p->threads = calloc(nthreads, sizeof(pthread_t));
+    for (int t = 0; t < nthreads; ++t)
+        pthread_create(&p->threads[t], NULL, legacy_thread, p);
+    return p;
+}
+
+static int
+legacy_add_group(void *pool, int length, void *(*done)(void *))
+{
+    legacy_pool_t *p = (legacy_pool_t *) pool;
+
+    p->tag_len = length;
+    p->tag_fn = done;
+    p->tag_arg = NULL;
+    return 0;
+}
+
+static int
+legacy_add_work(void *pool, void *(*function)(void *), void *arg, int group)
+{
+    legacy_pool_t *p = (legacy_pool_t *) pool;
+    legacy_job_t *job = malloc(sizeof(legacy_job_t));
+
+    (void) group;
+    job->next = NULL;
+    job->function = function;
+    job->arg = arg;
+    job->tag = strdup(p->tag);
+    pthread_mutex_lock(&p->rwmutex);
+    if (p->rear)
+        p->rear->next = job;
+    else
+        p->front = job;
+    p->rear = job;
+    p->len++;
+    legacy_bsem_post(p, false);
+    pthread_mutex_unlock(&p->rwmutex);
+    return 0;
+}
+
+static void
+legacy_wait(void *pool)
+{
+    legacy_pool_t *p = (legacy_pool_t *) pool;
+    int len;
+
+    pthread_mutex_lock(&p->thcount_lock);
+    for (;;) {
+        pthread_mutex_lock(&p->rwmutex);
+        len = p->len;
+        pthread_mutex_unlock(&p->rwmutex);
+        if (len == 0 && p->working == 0)
+            break;
+        pthread_cond_wait(&p->all_idle, &p->thcount_lock);
+    }
+    pthread_mutex_unlock(&p->thcount_lock);
+}
+
+static void
+legacy_destroy(void *pool)
+{
+    legacy_pool_t *p = (legacy_pool_t *) pool;
+
+    pthread_mutex_lock(&p->bsem_lock);
+    atomic_store(&p->keepalive, 0);
+    pthread_mutex_unlock(&p->bsem_lock);
+    legacy_bsem_post(p, true);
+    for (int t = 0; t < p->nthreads; ++t)
+        pthread_join(p->threads[t], NULL);
+    free(p->threads);
+    free(p->tag);
+    free(p);
+}
+
+/* The current pool, behind the same interface */
+
+static void *
+current_init(int nthreads, int nqueues)
+{
+    return thpool_init_queues(nthreads, nqueues);
+}
+
+static int
+current_add_group(void *pool, int length, void *(*done)(void *))
+{
+    return thpool_add_group((threadpool) pool, length, 0, done, NULL);
+}
+
+static int
+current_add_work(void *pool, void *(*function)(void *), void *arg, int group)
+{
+    return thpool_add_work((threadpool) pool, function, arg, group);
+}
+
+static void
+current_wait(void *pool)
+{
+    thpool_wait((threadpool) pool);
+}
+
+static void
+current_destroy(void *pool)
+{
+    thpool_destroy((threadpool) pool);
+}
+
+typedef struct {
+    void *(*init)(int nthreads, int nqueues);
+    int (*add_group)(void *pool, int length, void *(*done)(void *));
+    int (*add_work)(void *pool, void *(*function)(void *), void *arg,
+                    int group);
+    void (*wait)(void *pool);
+    void (*destroy)(void *pool);
+} bench_pool_t;
+
+static const bench_pool_t legacy_pool = {
+    legacy_init, legacy_add_group, legacy_add_work, legacy_wait,
+    legacy_destroy,
+};
+
+static const bench_pool_t current_pool = {
+    current_init, current_add_group, current_add_work, current_wait,
+    current_destroy,
+};
+
+struct bench_job_s {
+    uint64_t submitted;
+    uint64_t *latency;
+    uint64_t work_ns;
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+bench_job(void *vargs)
+{
+    struct bench_job_s *args = (struct bench_job_s *) vargs;
+    uint64_t start = now_ns();
+
+    *args->latency = start - args->submitted;
+    while (now_ns() - start < args->work_ns)
+        ;
+    return NULL;
+}
+
+struct bench_spawn_s {
+    const bench_pool_t *ops;
+    void *pool;
+    int group;
+    struct bench_job_s *jobs;
+    long njobs;
+};
+
+static void *
+bench_spawn(void *vargs)
+{
+    struct bench_spawn_s *args = (struct bench_spawn_s *) vargs;
+
+    for (long i = 0; i < args->njobs; ++i) {
+        args->jobs[i].submitted = now_ns();
+        args->ops->add_work(args->pool, bench_job, &args->jobs[i],
+                            args->group);
+    }
+    return NULL;
+}
+
+static void *
+bench_done(void *vargs)
+{
+    (void) vargs;
+    return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+bench(const char *name, const bench_pool_t *ops, int nthreads, int nqueues,
+      long njobs, uint64_t work_ns, bool fanout)
+{
+    void *pool;
+    int group;
+    struct bench_job_s *jobs;
+    struct bench_spawn_s *spawners = NULL;
+    uint64_t *latency, start, end;
+    double secs;
+
+    jobs = calloc(njobs, sizeof(struct bench_job_s));
+    latency = calloc(njobs, sizeof(uint64_t));
+    for (long i = 0; i < njobs; ++i) {
+        jobs[i].latency = &latency[i];
+        jobs[i].work_ns = work_ns;
+    }
+    pool = ops->init(nthreads, nqueues);
+    if (pool == NULL
+        || (group = ops->add_group(pool, njobs + (fanout ? nthreads : 0),
+                                   bench_done)) == -1) {
+        fprintf(stderr, "unable to set up thread pool\n");
+        exit(1);
+    }
+
+    start = now_ns();
+    if (fanout) {
+        spawners = calloc(nthreads, sizeof(struct bench_spawn_s));
+        for (int t = 0; t < nthreads; ++t) {
+            long lo = njobs * t / nthreads, hi = njobs * (t + 1) / nthreads;
+
+            spawners[t].ops = ops;
+            spawners[t].pool = pool;
+            spawners[t].group = group;
+            spawners[t].jobs = &jobs[lo];
+            spawners[t].njobs = hi - lo;
+            ops->add_work(pool, bench_spawn, &spawners[t], group);
+        }
+    } else {
+        for (long i = 0; i < njobs; ++i) {
+            jobs[i].submitted = now_ns();
+            ops->add_work(pool, bench_job, &jobs[i], group);
+        }
+    }
+    ops->wait(pool);
+    end = now_ns();
+    ops->destroy(pool);
+
+    qsort(latency, njobs, sizeof(uint64_t), cmp_u64);
+    secs = (end - start) / 1e9;
+    printf("%-18s %10.0f jobs/s   latency us: p50 %8.1f  p99 %8.1f  "
+           "p99.9 %8.1f  max %8.1f\n", name, njobs / secs,
+           latency[njobs / 2] / 1e3, latency[njobs * 99 / 100] / 1e3,
+           latency[njobs * 999 / 1000] / 1e3, latency[njobs - 1] / 1e3);
+
+    free(spawners);
+    free(latency);
+    free(jobs);
+}
+
+int
+main(int argc, char **argv)
+{
+    int nthreads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    long njobs = argc > 2 ? atol(argv[2]) : 1000000;
+    uint64_t work_ns = argc > 3 ? strtoull(argv[3], NULL, 10) : 1000;
+
+    if (nthreads < 1 || njobs < 1) {
+        fprintf(stderr, "usage: %s [nthreads] [njobs] [work_ns]\n", argv[0]);
+        return 1;
+    }
+    printf("%d threads, %ld jobs of %lu ns\n", nthreads, njobs, work_ns);
+    for (int fanout = 0; fanout < 2; ++fanout) {
+        if (fanout)
+            printf("fanned out by %d spawner jobs\n", nthreads);
+        bench("baseline", &legacy_pool, nthreads, 1, njobs, work_ns, fanout);
+        bench("single queue", &current_pool, nthreads, 1, njobs, work_ns,
+              fanout);
+        bench("per-thread queues", &current_pool, nthreads, nthreads, njobs,
+              work_ns, fanout);
+    }
+    return 0;
+}
@@ -3,84 +3,362 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <mmap/mmap.h>
 #include <mmap/mmap_clt.h>
 #include <mmap/mmap_gghlite.h>
 
+void
+budget_init(struct budget_s *b)
+{
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->written, NULL);
+    b->maxlayers = b->maxbytes = 0;
+    b->layers = b->bytes = 0;
+    b->encsize = 0;
+}
+
+void
+budget_clear(struct budget_s *b)
+{
+    pthread_cond_destroy(&b->written);
+    pthread_mutex_destroy(&b->lock);
+}
+
+/*
+ * Blocks until a layer of nencs encodings fits in the budget, and returns the
+ * number of bytes reserved for it.  A layer is always admitted when none are
+ * in flight, and only one is admitted under a byte limit until the size of an
+ * encoding is known.
+ */
+uint64_t
+budget_acquire(struct budget_s *b, uint64_t nencs)
+{
+    uint64_t bytes;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        bytes = nencs * b->encsize;
+        if (b->layers == 0)
+            break;
+        if ((b->maxlayers == 0 || b->layers < b->maxlayers)
+            && (b->maxbytes == 0
+                || (b->encsize && b->bytes + bytes <= b->maxbytes)))
+            break;
+        pthread_cond_wait(&b->written, &b->lock);
+    }
+    b->layers++;
+    b->bytes += bytes;
+    pthread_mutex_unlock(&b->lock);
+
+    return bytes;
+}
+
+/*
+ * Returns a written layer's reservation, recording the serialized size of one
+ * of its encodings if it is nonzero.
+ */
+void
+budget_release(struct budget_s *b, uint64_t bytes, size_t encsize)
+{
+    pthread_mutex_lock(&b->lock);
+    b->layers--;
+    b->bytes -= bytes;
+    if (encsize)
+        b->encsize = encsize;
+    pthread_cond_broadcast(&b->written);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void
+snapshot_init(struct snapshot_s *sn)
+{
+    pthread_mutex_init(&sn->lock, NULL);
+    pthread_cond_init(&sn->changed, NULL);
+    sn->encoding = 0;
+    sn->saving = false;
+}
+
+void
+snapshot_clear(struct snapshot_s *sn)
+{
+    pthread_mutex_destroy(&sn->lock);
+    pthread_cond_destroy(&sn->changed);
+}
+
+void
+snapshot_enter(struct snapshot_s *sn)
+{
+    pthread_mutex_lock(&sn->lock);
+    while (sn->saving)
+        pthread_cond_wait(&sn->changed, &sn->lock);
+    sn->encoding++;
+    pthread_mutex_unlock(&sn->lock);
+}
+
+void
+snapshot_leave(struct snapshot_s *sn)
+{
+    pthread_mutex_lock(&sn->lock);
+    if (--sn->encoding == 0)
+        pthread_cond_broadcast(&sn->changed);
+    pthread_mutex_unlock(&sn->lock);
+}
+
+/* Waits until no encode job is in the snapshot and keeps new ones out */
+void
+snapshot_begin(struct snapshot_s *sn)
+{
+    pthread_mutex_lock(&sn->lock);
+    while (sn->saving)
+        pthread_cond_wait(&sn->changed, &sn->lock);
+    sn->saving = true;
+    while (sn->encoding > 0)
+        pthread_cond_wait(&sn->changed, &sn->lock);
+    pthread_mutex_unlock(&sn->lock);
+}
+
+void
+snapshot_end(struct snapshot_s *sn)
+{
+    pthread_mutex_lock(&sn->lock);
+    sn->saving = false;
+    pthread_cond_broadcast(&sn->changed);
+    pthread_mutex_unlock(&sn->lock);
+}
+
+int
+matrix_stream_init(struct matrix_stream_s *st, FILE *fp, const char *dir,
+                   long idx, uint64_t slot, long ntiles)
+{
+    st->fp = fp;
+    st->dir = dir;
+    st->idx = idx;
+    st->slot = slot;
+    st->ntiles = ntiles;
+    st->next = 0;
+    st->writing = false;
+    st->failed = false;
+    st->bytes = 0;
+    st->bufs = calloc(ntiles, sizeof(char *));
+    st->lens = calloc(ntiles, sizeof(size_t));
+    st->ready = calloc(ntiles, sizeof(bool));
+    if (st->bufs == NULL || st->lens == NULL || st->ready == NULL) {
+        free(st->bufs);
+        free(st->lens);
+        free(st->ready);
+        return OBFUSCATOR_ERR;
+    }
+    pthread_mutex_init(&st->lock, NULL);
+    return OBFUSCATOR_OK;
+}
+
+void
+matrix_stream_clear(struct matrix_stream_s *st)
+{
+    /* tiles never written, if the stream was abandoned */
+    for (long t = st->next; t < st->ntiles; ++t) {
+        free(st->bufs[t]);
+    }
+    free(st->bufs);
+    free(st->lens);
+    free(st->ready);
+    pthread_mutex_destroy(&st->lock);
+}
+
+/* Writes tile t, opening the stream's file first if need be */
+static bool
+matrix_stream_write(struct matrix_stream_s *st, long t)
+{
+    if (st->bufs[t] == NULL)
+        return false;
+    if (st->fp == NULL) {
+        char name[21];
+        (void) snprintf(name, sizeof name, "%lu", st->slot);
+        if ((st->fp = open_indexed_file(st->dir, name, st->idx, "w+b"))
+            == NULL)
+            return false;
+    }
+    return fwrite(st->bufs[t], 1, st->lens[t], st->fp) == st->lens[t];
+}
+
+/*
+ * Hands over the serialized tile `tile` (NULL if serializing it failed), and
+ * writes out every tile that is now next in row order unless another thread
+ * is already doing so.  The file is only touched by one thread at a time, but
+ * the lock is not held while writing.
+ */
+static void
+matrix_stream_put(struct matrix_stream_s *st, long tile, char *buf,
+                  size_t len)
+{
+    pthread_mutex_lock(&st->lock);
+    st->bufs[tile] = buf;
+    st->lens[tile] = len;
+    st->ready[tile] = true;
+    if (st->writing) {
+        pthread_mutex_unlock(&st->lock);
+        return;
+    }
+    st->writing = true;
+    while (st->next < st->ntiles && st->ready[st->next]) {
+        long t = st->next++;
+        bool ok;
+
+        pthread_mutex_unlock(&st->lock);
+        ok = matrix_stream_write(st, t);
+        free(st->bufs[t]);
+        pthread_mutex_lock(&st->lock);
+        st->bufs[t] = NULL;
+        st->bytes += st->lens[t];
+        if (!ok)
+            st->failed = true;
+    }
+    st->writing = false;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/*
+ * Encodes a tile one entry at a time into a single scratch encoding,
+ * serializing each as it is produced, so that a tile only ever holds its
+ * serialized rows.  Tiles of a stream that has already failed are skipped.
+ * The encoding randomness comes from the secret key's shared state, so which
+ * tile draws what depends on the order tiles run in.
+ */
 void *
-thpool_encode_elem(void *vargs)
+thpool_encode_tile(void *vargs)
 {
-    struct encode_elem_s *args = (struct encode_elem_s *) vargs;
+    struct encode_tile_s *args = (struct encode_tile_s *) vargs;
+    const mmap_vtable *vtable = args->vtable;
+    mmap_enc *enc;
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp;
+    bool failed;
+
+    pthread_mutex_lock(&args->stream->lock);
+    failed = args->stream->failed;
+    pthread_mutex_unlock(&args->stream->lock);
+    if (failed) {
+        matrix_stream_put(args->stream, args->tile, NULL, 0);
+        free(args);
+        return NULL;
+    }
 
-    args->vtable->enc->encode(args->enc, args->sk, args->n, args->plaintext,
-                              args->group);
+    enc = malloc(vtable->enc->size);
+    vtable->enc->init(enc, vtable->sk->pp(args->sk));
+    if ((fp = open_memstream(&buf, &len)) != NULL) {
+        for (long i = args->row; i < args->row + args->nrows; ++i) {
+            for (long j = 0; j < args->mat->c; ++j) {
+                if (args->snapshot)
+                    snapshot_enter(args->snapshot);
+                vtable->enc->encode(
+                    enc, args->sk, 1,
+                    (const fmpz_t *) fmpz_mat_entry(args->mat, i, j),
+                    args->group);
+                if (args->snapshot)
+                    snapshot_leave(args->snapshot);
+                vtable->enc->fwrite(enc, fp);
+            }
+        }
+        if (fclose(fp) != 0) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    vtable->enc->clear(enc);
+    free(enc);
 
-    for (int i = 0; i < args->n; ++i)
-        fmpz_clear(args->plaintext[i]);
-    free(args->plaintext);
+    matrix_stream_put(args->stream, args->tile, buf, len);
     free(args);
 
     return NULL;
 }
 
+/* Closes fp, first forcing it to disk if sync is set */
+static int
+close_file(FILE *fp, bool sync)
+{
+    int ret = 0;
+
+    if (sync && (fflush(fp) != 0 || fsync(fileno(fp)) != 0))
+        ret = EOF;
+    if (fclose(fp) != 0)
+        ret = EOF;
+    return ret;
+}
+
+static int
+write_long_file(const char *dir, uint64_t idx, const char *name, long x,
+                bool sync)
+{
+    FILE *fp;
+
+    if ((fp = open_indexed_file(dir, name, idx, "w+b")) == NULL)
+        return OBFUSCATOR_ERR;
+    fwrite(&x, sizeof x, 1, fp);
+    if (close_file(fp, sync) != 0)
+        return OBFUSCATOR_ERR;
+    return OBFUSCATOR_OK;
+}
+
 void *
 thpool_write_layer(void *vargs)
 {
-    char fname[1024];
-    int fnamelen = 1024;
-    FILE *fp;
-    double end;
     struct write_layer_s *args = (struct write_layer_s *) vargs;
+    uint64_t nbytes = 0;
+    bool failed = false;
+    double end;
 
-    (void) snprintf(fname, fnamelen, "%s/%ld.input", args->dir, args->idx);
-    fp = fopen(fname, "w+b");
-    if (fp == NULL) {
-        fprintf(stderr, "Unable to write '%s'\n", fname);
-        goto done;
-    }
-    fwrite(&args->inp, sizeof args->inp, 1, fp);
-    fclose(fp);
-
-    (void) snprintf(fname, fnamelen, "%s/%ld.nrows", args->dir, args->idx);
-    fp = fopen(fname, "w+b");
-    if (fp == NULL) {
-        fprintf(stderr, "Unable to write '%s'\n", fname);
-        goto done;
-    }
-    fwrite(&args->nrows, sizeof args->nrows, 1, fp);
-    fclose(fp);
-
-    (void) snprintf(fname, fnamelen, "%s/%ld.ncols", args->dir, args->idx);
-    fp = fopen(fname, "w+b");
-    if (fp == NULL) {
-        fprintf(stderr, "Unable to write '%s'\n", fname);
-        goto done;
+    /* All tiles are encoded and written, so the plaintexts can go */
+    for (uint64_t c = 0; c < args->n; ++c) {
+        fmpz_mat_clear(args->mats[c]);
     }
-    fwrite(&args->ncols, sizeof args->ncols, 1, fp);
-    fclose(fp);
+    free(args->mats);
 
     for (uint64_t c = 0; c < args->n; ++c) {
-        (void) snprintf(fname, fnamelen, "%s/%ld.%s", args->dir, args->idx, args->names[c]);
-        fp = fopen(fname, "w+b");
-        if (fp == NULL) {
-            fprintf(stderr, "Unable to write '%s'\n", fname);
-            goto done;
-        }
-        for (long i = 0; i < args->nrows; ++i) {
-            for (long j = 0; j < args->ncols; ++j) {
-                args->vtable->enc->fwrite(args->enc_mats[c][0]->m[i][j], fp);
-            }
+        struct matrix_stream_s *st = &args->streams[c];
+        /* a stream is short if its layer was abandoned, and has no file if
+         * no tile was ever written */
+        if (st->fp == NULL || close_file(st->fp, args->checkpoint) != 0
+            || st->failed || st->next != st->ntiles)
+            failed = true;
+        nbytes += st->bytes;
+        matrix_stream_clear(st);
+    }
+    free(args->streams);
+
+    if (args->container) {
+        if (failed
+            || container_write_layer(args->container, args->idx, args->inp,
+                                     args->nrows, args->ncols, args->n,
+                                     args->bufs, args->lens) == -1)
+            fprintf(stderr, "Unable to write layer %ld\n", args->idx);
+        for (uint64_t c = 0; c < args->n; ++c) {
+            free(args->bufs[c]);
         }
-        mmap_enc_mat_clear(args->vtable, *args->enc_mats[c]);
-        free(args->enc_mats[c]);
-        free(args->names[c]);
-        fclose(fp);
+    } else {
+        const char *dir = args->dir;
+        const long idx = args->idx;
+        const bool sync = args->checkpoint;
+        if (failed
+            || write_long_file(dir, idx, "input", args->inp, sync) == -1
+            || write_long_file(dir, idx, "nrows", args->nrows, sync) == -1
+            || write_long_file(dir, idx, "ncols", args->ncols, sync) == -1)
+            fprintf(stderr, "Unable to write layer %ld\n", idx);
+        /* Only once everything else is on disk, and the key's random state
+         * is saved past this layer's encodings, may a resumed run skip it */
+        else if (sync && (args->save_state(args->state) == OBFUSCATOR_ERR
+                          || write_long_file(dir, idx, "done", 1, true)
+                          == -1))
+            fprintf(stderr, "Unable to mark layer %ld done\n", idx);
     }
-    free(args->enc_mats);
-    free(args->names);
+    free(args->bufs);
+    free(args->lens);
 
-done:
+    budget_release(args->budget, args->bytes,
+                   nbytes / (args->n * args->nrows * args->ncols));
     end = current_time();
     if (args->verbose)
         (void) fprintf(stderr, "  Encoding %ld elements: %f\n",
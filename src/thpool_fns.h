@@ -1,37 +1,131 @@
 #ifndef THPOOL_FNS
 #define THPOOL_FNS
 
+#include "container.h"
 #include "utils.h"
 
 #include <aesrand.h>
 #include <mmap/mmap.h>
+#include <pthread.h>
 #include <stdint.h>
 
-struct encode_elem_s {
+/*
+ * Bounds the layers queued for encoding but not yet written: at most maxlayers
+ * layers and maxbytes bytes of encodings, where 0 means no limit.  Layer sizes
+ * are estimated from the serialized size of an encoding, measured as each
+ * layer is written.
+ */
+struct budget_s {
+    pthread_mutex_t lock;
+    pthread_cond_t written;
+    uint64_t maxlayers;
+    uint64_t maxbytes;
+    uint64_t layers;
+    uint64_t bytes;
+    size_t encsize;
+};
+
+void
+budget_init(struct budget_s *b);
+void
+budget_clear(struct budget_s *b);
+uint64_t
+budget_acquire(struct budget_s *b, uint64_t nencs);
+void
+budget_release(struct budget_s *b, uint64_t bytes, size_t encsize);
+
+/*
+ * Lets the checkpoint state be saved while layers are being encoded.  Encode
+ * jobs enter the snapshot while they draw from the secret key; saving the
+ * state waits for those in it and holds back new ones, so the key's random
+ * state is saved between two encodings.
+ */
+struct snapshot_s {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint64_t encoding;
+    bool saving;
+};
+
+void
+snapshot_init(struct snapshot_s *sn);
+void
+snapshot_clear(struct snapshot_s *sn);
+void
+snapshot_enter(struct snapshot_s *sn);
+void
+snapshot_leave(struct snapshot_s *sn);
+void
+snapshot_begin(struct snapshot_s *sn);
+void
+snapshot_end(struct snapshot_s *sn);
+
+/*
+ * Writes the tiles of one (layer, slot) matrix to fp in row order as they are
+ * encoded, so that a layer's encodings never have to be held in memory at
+ * once.  Tiles may finish in any order; those that arrive early wait in bufs.
+ * Without fp the stream writes to the file "<idx>.<slot>" in dir, opened when
+ * the first tile is written so that queued layers do not hold descriptors.
+ */
+struct matrix_stream_s {
+    pthread_mutex_t lock;
+    FILE *fp;
+    const char *dir;
+    long idx;
+    uint64_t slot;
+    long ntiles;
+    long next;                  /* first tile not yet written */
+    bool writing;
+    bool failed;
+    char **bufs;
+    size_t *lens;
+    bool *ready;
+    uint64_t bytes;
+};
+
+int
+matrix_stream_init(struct matrix_stream_s *st, FILE *fp, const char *dir,
+                   long idx, uint64_t slot, long ntiles);
+void
+matrix_stream_clear(struct matrix_stream_s *st);
+
+/* Encodes rows [row, row + nrows) of a plaintext matrix as one job */
+struct encode_tile_s {
     const mmap_vtable *vtable;
     mmap_ro_sk sk;
-    int n;
-    fmpz_t *plaintext;
+    fmpz_mat_struct *mat;
+    long row;
+    long nrows;
     int *group;
-    mmap_enc *enc;
-    aes_randstate_t *rand;
+    struct matrix_stream_s *stream;
+    long tile;
+    struct snapshot_s *snapshot; /* NULL unless checkpointing */
 };
 
 void *
-thpool_encode_elem(void *vargs);
+thpool_encode_tile(void *vargs);
 
 struct write_layer_s {
     const mmap_vtable *vtable;
     const char *dir;
+    container_t *container;
     uint64_t n;
-    mmap_enc_mat_t **enc_mats;
-    char **names;
+    fmpz_mat_t *mats;
+    struct matrix_stream_s *streams;
+    char **bufs;                /* containers: each slot's serialized matrix */
+    size_t *lens;
     long inp;
     long idx;
     long nrows;
     long ncols;
     double start;
     bool verbose;
+    bool checkpoint;            /* sync the layer, save the state and mark
+                                   the layer done */
+    int (*save_state)(void *);
+    void *state;
+    struct budget_s *budget;
+    uint64_t bytes;
 };
 
 void *
@@ -8,7 +8,9 @@
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <mmap/mmap_clt.h>
 #include <mmap/mmap_gghlite.h>
+#include <mmap/mmap_dummy.h>
 
 double
 current_time(void)
@@ -38,6 +40,31 @@ open_file(const char *dir, const char *file, const char *mode)
     return fp;
 }
 
+FILE *
+open_indexed_file(const char *dir, const char *file, uint64_t index,
+                  const char *mode)
+{
+    char fname[50];
+
+    (void) snprintf(fname, 50, "%lu.%s", index, file);
+    return open_file(dir, fname, mode);
+}
+
+const mmap_vtable *
+get_vtable(enum mmap_e type)
+{
+    switch (type) {
+    case MMAP_DUMMY:
+        return &dummy_vtable;
+    case MMAP_CLT:
+        return &clt_vtable;
+    case MMAP_GGHLITE:
+        return &gghlite_vtable;
+    default:
+        return NULL;
+    }
+}
+
 int
 load_mpz_scalar(const char *fname, mpz_t x)
 {
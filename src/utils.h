@@ -1,7 +1,10 @@
 #ifndef __OBFUSCATION__UTILS_H__
 #define __OBFUSCATION__UTILS_H__
 
+#include "obfuscator.h"
+
 #include <gmp.h>
+#include <mmap/mmap.h>
 #include <stdio.h>
 
 #define AES_SEED_BYTE_SIZE 32
@@ -12,6 +15,13 @@ current_time(void);
 FILE *
 open_file(const char *dir, const char *file, const char *mode);
 
+FILE *
+open_indexed_file(const char *dir, const char *file, uint64_t index,
+                  const char *mode);
+
+const mmap_vtable *
+get_vtable(enum mmap_e type);
+
 int
 load_mpz_scalar(const char *fname, mpz_t x);
 
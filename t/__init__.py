@@ -42,6 +42,19 @@ def test_load(mmap, secparam):
     lst = [CMD, "obf", "--load-obf", path + ".obf.%d" % secparam, "--mmap", mmap, "--eval", eval]
     return run(lst)
 
+def test_container(mmap, secparam):
+    print_test('Testing single-file obfuscation')
+    circuit = 'and.circ'
+    eval = '11'
+    path = os.path.join(CIRCUIT_PATH, circuit)
+    lst = [CMD, "obf", "--test", path, "--secparam", str(secparam), "--mmap",
+           mmap, "--container"]
+    r = run(lst)
+    if r:
+        return r
+    lst = [CMD, "obf", "--load-obf", path + ".obf.%d" % secparam, "--mmap", mmap, "--eval", eval]
+    return run(lst)
+
 def test(f, *args):
     if f(*args):
         print(failure_str)
@@ -57,6 +70,8 @@ def test_all():
     print("TESTING LOAD")
     test(test_load, "CLT", 16)
     test(test_load, "GGH", 16)
+    print("TESTING CONTAINER")
+    test(test_container, "CLT", 16)
 
 try:
     test_all()